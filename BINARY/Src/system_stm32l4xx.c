@@ -123,8 +123,12 @@
 /*!< Uncomment the following line if you need to relocate your vector Table in
      Internal SRAM. */
 /* #define VECT_TAB_SRAM */
+#ifndef VECT_TAB_OFFSET
 #define VECT_TAB_OFFSET  0x8000 /*!< Vector Table base offset field.
-                                   This value must be a multiple of 0x200. */
+                                   This value must be a multiple of 0x200.
+                                   IAP slot A, the BINARY_B configuration
+                                   sets 0x23000 for slot B. */
+#endif
 /******************************************************************************/
 /**
   * @}
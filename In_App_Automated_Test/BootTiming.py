@@ -0,0 +1,51 @@
+## BootTiming.py
+ # Author: Donovan Bidlack
+ #
+ # Reads the boot timing of the STM (IAP_CMD_BOOT_TIMING), the DWT cycle
+ # count from reset at the end of each boot phase, and prints how long each
+ # phase took. Only the phases that ran this boot are shown: staying in the
+ # IAP skips the jump, booting the application skips the rest.
+ #
+ # Usage: python BootTiming.py
+
+from __future__ import print_function
+import sys
+from array import array
+import Komodo
+
+CAN_IAP_UPDATE_FIRMWARE = 0x600
+CAN_IAP_CRC             = 0x601
+IAP_EXTENDED_COMMAND    = 0x06
+IAP_CMD_BOOT_TIMING     = 0x1E
+IAP_BOOT_TIMING         = 0xAD
+PHASES = ['reset to main', 'marker checks', 'HAL_DeInit and jump', 'HAL_Init', 'SystemClock_Config', 'IAP_init and CAN']
+
+komodo_port = Komodo.connect()
+marks = []
+for phase in range(len(PHASES)):
+    Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND,\
+                array('B', [IAP_CMD_BOOT_TIMING, phase, 0, 0, 0, 0]))
+    reply = Komodo.poll(komodo_port, 1000)
+    if reply is None or reply[0] != CAN_IAP_CRC or reply[1][0] != IAP_BOOT_TIMING:
+        print('!!!!!!!!! No boot timing response from STM !!!!!!!!')
+        Komodo.close(komodo_port)
+        sys.exit(1)
+    data = reply[1]
+    marks.append(((data[2] << 24) | (data[3] << 16) | (data[4] << 8) | data[5], data[6]))
+Komodo.close(komodo_port)
+
+# A phase is timed at the clock it started at, SystemClock_Config spends most
+# of its time waiting for the PLL before the clock goes up
+previous = 0
+previous_mhz = marks[0][1]
+total = 0.0
+for phase in range(len(PHASES)):
+    (cycles, mhz) = marks[phase]
+    if cycles == 0:
+        continue
+    us = (cycles - previous) / float(max(previous_mhz, 1))
+    total += us
+    print('%-20s %10d cycles %4d MHz %10.1f us' % (PHASES[phase], cycles - previous, previous_mhz, us))
+    previous = cycles
+    previous_mhz = mhz
+print('%-20s %42.1f us' % ('total', total))
@@ -0,0 +1,40 @@
+# CRC16.py
+ # Author: Donovan Bidlack
+ #
+ # CRC16_CCITT_ZERO (XModem) used by the In App Programming, the same
+ # CRC the STM computes in IAP_Calculate_CRC16 / IAP_CRC16_Software.
+
+import binascii
+
+def CRC16_Bitwise(crc, data):
+    crc ^= data << 8
+    for j in range(0,8):
+        if (crc & 0x8000) > 0:
+           crc =(crc << 1) ^ 0x1021
+        else:
+           crc = crc << 1
+    return crc & 0xFFFF
+
+# CRC16_TABLE[0] is the byte-at-a-time table, CRC16_TABLE[k] is table 0
+# advanced by k zero bytes (slicing-by-8), same as IAP_CRC16_Table
+CRC16_TABLE = [[CRC16_Bitwise(0, i) for i in range(256)]]
+for k in range(1, 8):
+    CRC16_TABLE.append([((v << 8) & 0xFFFF) ^ CRC16_TABLE[0][v >> 8] for v in CRC16_TABLE[k-1]])
+
+def CRC16_Calculate(crc, data):
+    return ((crc << 8) & 0xFFFF) ^ CRC16_TABLE[0][(crc >> 8) ^ data]
+
+def CRC16_Slice8(crc, data):
+    data = bytearray(data)
+    T0, T1, T2, T3, T4, T5, T6, T7 = CRC16_TABLE
+    end = len(data) - (len(data) % 8)
+    for i in range(0, end, 8):
+        crc = T7[data[i] ^ (crc >> 8)] ^ T6[data[i+1] ^ (crc & 0xFF)] ^ T5[data[i+2]] ^ T4[data[i+3]] ^\
+              T3[data[i+4]] ^ T2[data[i+5]] ^ T1[data[i+6]] ^ T0[data[i+7]]
+    for byte in data[end:]:
+        crc = ((crc << 8) & 0xFFFF) ^ T0[(crc >> 8) ^ byte]
+    return crc
+
+def CRC16_Block(crc, data):
+    # binascii.crc_hqx is the same CRC done in C over the whole buffer
+    return binascii.crc_hqx(bytes(data), crc)
@@ -0,0 +1,111 @@
+## CRC16Benchmark.py
+ # Author: Donovan Bidlack
+ #
+ # Checks that every host CRC16 implementation in CRC16.py gives the same
+ # result on random images and reports their throughput. With --target the
+ # STM is asked (IAP_CMD_CRC_BENCH) to CRC the same pseudo-random data with
+ # each of its engines and to SHA-256 it, the results are compared and the
+ # throughput reported in bytes/cycle and cycles/byte.
+ #
+ # Usage: python CRC16Benchmark.py [--target]
+
+from __future__ import print_function
+import os
+import sys
+import time
+import random
+import hashlib
+from array import array
+from CRC16 import CRC16_Bitwise, CRC16_Calculate, CRC16_Slice8, CRC16_Block
+
+CAN_IAP_UPDATE_FIRMWARE = 0x600
+CAN_IAP_CRC             = 0x601
+IAP_EXTENDED_COMMAND    = 0x06
+IAP_CMD_CRC_BENCH       = 0x14
+IAP_CRC_BENCH           = 0xA3
+IAP_PAGE_BUFFER_FRAMES  = 256
+ENGINES = {1: 'table', 2: 'slice-by-8', 3: 'hardware', 4: 'SHA-256'}
+IAP_CRC_ENGINE_SHA256   = 4
+
+IMAGES = 20
+MAX_IMAGE_SIZE = 224 * 1024
+
+def Bitwise(crc, data):
+    for byte in bytearray(data):
+        crc = CRC16_Bitwise(crc, byte)
+    return crc
+
+def Table(crc, data):
+    for byte in bytearray(data):
+        crc = CRC16_Calculate(crc, byte)
+    return crc
+
+def Xorshift32(seed, length):
+    seed = seed or 1
+    out = bytearray()
+    while len(out) < length:
+        seed ^= (seed << 13) & 0xFFFFFFFF
+        seed ^= seed >> 17
+        seed ^= (seed << 5) & 0xFFFFFFFF
+        out += bytearray([seed & 0xFF, (seed >> 8) & 0xFF, (seed >> 16) & 0xFF, seed >> 24])
+    return out[:length]
+
+def Host_Benchmark():
+    implementations = [('bitwise', Bitwise), ('table', Table), ('slice-by-8', CRC16_Slice8), ('crc_hqx', CRC16_Block)]
+    seconds = dict((name, 0.0) for (name, _) in implementations)
+    total = 0
+    hash_seconds = 0.0
+    for image in range(IMAGES):
+        data = os.urandom(random.randint(1, MAX_IMAGE_SIZE))
+        start = random.randint(0, 0xFFFF)
+        results = []
+        for (name, function) in implementations:
+            begin = time.time()
+            results.append(function(start, data))
+            seconds[name] += time.time() - begin
+        if len(set(results)) != 1:
+            print('!!!!!!!!!!!! CRC MISMATCH on image', image, [format(r, '04X') for r in results])
+            sys.exit(1)
+        begin = time.time()
+        hashlib.sha256(data).digest()
+        hash_seconds += time.time() - begin
+        total += len(data)
+    print('Host: %d random images, %d bytes, all implementations agree' % (IMAGES, total))
+    for (name, _) in implementations:
+        print('  %-11s %8.2f MB/s' % (name, total / seconds[name] / 1e6))
+    print('  %-11s %8.2f MB/s' % ('sha256', total / max(hash_seconds, 1e-9) / 1e6))
+
+def Target_Benchmark():
+    import Komodo
+    komodo_port = Komodo.connect()
+    length = IAP_PAGE_BUFFER_FRAMES * 8
+    for _ in range(IMAGES):
+        seed = random.randint(1, 0xFFFFFFFF)
+        data = Xorshift32(seed, length)
+        expected = CRC16_Block(0, data)
+        digest = bytearray(hashlib.sha256(data).digest())
+        # A whole flash page does not fit the length byte, 0 stands for it
+        Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND,\
+                    array('B', [IAP_CMD_CRC_BENCH, seed >> 24, (seed >> 16) & 0xFF, (seed >> 8) & 0xFF,\
+                                seed & 0xFF, IAP_PAGE_BUFFER_FRAMES & 0xFF]))
+        for _ in ENGINES:
+            reply = Komodo.poll(komodo_port, 1000)
+            if reply is None or reply[0] != CAN_IAP_CRC or reply[1][0] != IAP_CRC_BENCH:
+                print('!!!!!!!!! No benchmark response from STM !!!!!!!!')
+                Komodo.close(komodo_port)
+                sys.exit(1)
+            reply = reply[1]
+            crc = (reply[2] << 8) | reply[3]
+            cycles = (reply[4] << 24) | (reply[5] << 16) | (reply[6] << 8) | reply[7]
+            # The SHA-256 engine answers with the first two bytes of its digest
+            check = (digest[0] << 8) | digest[1] if reply[1] == IAP_CRC_ENGINE_SHA256 else expected
+            print('STM %-11s seed %08X CRC %04X %s  %.3f bytes/cycle %7.2f cycles/byte' % (ENGINES[reply[1]], seed, crc,\
+                  'OK ' if crc == check else 'BAD', length / float(max(cycles, 1)), cycles / float(length)))
+            if crc != check:
+                Komodo.close(komodo_port)
+                sys.exit(1)
+    Komodo.close(komodo_port)
+
+Host_Benchmark()
+if '--target' in sys.argv:
+    Target_Benchmark()
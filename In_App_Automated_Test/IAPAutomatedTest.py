@@ -10,25 +10,22 @@
 import time
 import Komodo
 import binascii
+import zlib
+import hashlib
 import sys
+import signal
 from array import array
-
-with open('YOURFILEHERE.bin', 'rb') as f:
-    program = binascii.hexlify(f.read())
-
-def CRC16_Calculate(crc, data):
-    crc ^= data << 8
-    for j in range(0,8):
-        if (crc & 0x8000) > 0:
-           crc =(crc << 1) ^ 0x1021
-        else:
-           crc = crc << 1
-    return crc & 0xFFFF
+from CRC16 import CRC16_Calculate, CRC16_Block
+from LZSS import LZSS_Compress
 
 # Constants from IN_APP_PRGRM.h
 IAP_FRAMES_PER_PAGE = 250
 CAN_IAP_UPDATE_FIRMWARE = 0x600
 CAN_IAP_CRC = 0x601
+CAN_IAP_DATA = 0x602
+CAN_IAP_CONTROL = 0x603
+CAN_IAP_NODE_RESPONSE_BASE = 0x680
+IAP_SEQUENCED_ID_SHIFT = 18
 
 IAP_PROGRAM_START       = 0x05
 IAP_PROGRAMM_END        = 0xCC
@@ -37,8 +34,68 @@ IAP_LOAD_NEW_PROGRAM    = 0x02
 IAP_WRITE_TO_FLASH      = 0x08
 IAP_CRC_SUCCEEDED       = 0x03
 IAP_CRC_FAILED          = 0x07
+IAP_WRITE_FAILED        = 0x21
 IAP_ERASE_FAILED        = 0x22
+IAP_IMAGE_TOO_LARGE     = 0x23
+IAP_SAME_VERSION        = 0x24
+IAP_WRONG_SLOT          = 0x25
+IAP_BAD_HEADER          = 0x26
+IAP_AUTH_FAILED         = 0x27
+IAP_ABORTED             = 0x28
+IAP_START_HEADER        = 0x59
+IAP_START_SIZED         = 0x5A
+IAP_START_DELTA         = 0x5D
+IAP_START_COMPRESSED    = 0x5C
+IAP_START_BROADCAST     = 0x5B
+IAP_READY               = 0xAA
 IAP_LAST_FRAME          = 0x04
+IAP_EXTENDED_COMMAND    = 0x06
+
+IAP_CMD_WINDOW_START    = 0x10
+IAP_CMD_PAGE_CHECK      = 0x11
+IAP_CMD_REWIND          = 0x12
+IAP_CMD_IMAGE_CHECK     = 0x13
+IAP_WINDOW_ACK          = 0xA0
+IAP_WINDOW_NACK         = 0xA1
+IAP_IMAGE_CRC           = 0xA2
+IAP_CMD_SLOT_STATUS     = 0x16
+IAP_SLOT_STATUS         = 0xA5
+IAP_SLOT_A              = 0x01
+IAP_SLOT_B              = 0x02
+IAP_CMD_PAGE_MANIFEST   = 0x17
+IAP_CMD_PAGE_WRITE      = 0x18
+IAP_PAGE_HASH           = 0xA6
+IAP_PAGE_WRITTEN        = 0xA7
+IAP_CMD_NODE_QUERY      = 0x19
+IAP_NODE_INFO           = 0xA8
+IAP_CMD_MISSING_FRAMES  = 0x1A
+IAP_MISSING_FRAMES      = 0xA9
+IAP_MISSING_REPORT_MAX  = 30
+IAP_CMD_RESUME_QUERY    = 0x1B
+IAP_CMD_RESUME          = 0x1C
+IAP_RESUME_STATUS       = 0xAC
+IAP_CMD_IMAGE_CRC32     = 0x1D
+IAP_CMD_TELEMETRY       = 0x1F
+IAP_CMD_IMAGE_HEADER    = 0x20
+IAP_CMD_IMAGE_SHA256    = 0x21
+IAP_CMD_ABORT           = 0x22
+IAP_HEADER_MAGIC        = 0x49415048
+IAP_HEADER_VERSION      = 1
+IAP_HEADER_SIZE         = 24
+IAP_HEADER_COMPRESSED   = 0x01
+IAP_HEADER_DELTA        = 0x02
+IAP_TELEMETRY           = 0xAE
+TELEMETRY_COUNTERS = ['frames received', 'RX queue overruns', 'data FIFO overruns', 'program retries',\
+                      'erase retries', 'CRC failures', 'erase cycles', 'program cycles', 'CRC cycles', 'last error',\
+                      'hash cycles', 'control filter hits', 'data filter hits', 'sequenced filter hits',\
+                      'control FIFO overruns', 'TX queue overruns', 'RX ISR cycles', 'RX ISR frames',\
+                      'command filter hits']
+FLASH_PAGE_SIZE         = 2048
+
+# Each image is linked for the slot it runs from (A at 0x08008000, B at
+# 0x08023000), the STM always downloads into the slot that is not running
+SLOT_IMAGES = {IAP_SLOT_A: 'YOURFILEHERE.bin', IAP_SLOT_B: 'YOURFILEHERE_B.bin'}
+SLOT_ADDRESSES = {IAP_SLOT_A: 0x08008000, IAP_SLOT_B: 0x08023000}
 
 # Variables used in IN_APP_PRGRM.c
 Program_CRC = 0
@@ -51,96 +108,598 @@ komodo_port = Komodo.connect()
 sleeptime = .1
 longsleeptime = 2
 
+# Flash pages (2 KB) sent between two CRC checks, 1 to 8. Bigger blocks mean
+# fewer round trips, 0 keeps the old 250 frame pages that straddle flash pages
+IAP_BLOCK_PAGES = 4
+Block_Frames = IAP_BLOCK_PAGES * FLASH_PAGE_SIZE / 8 if IAP_BLOCK_PAGES else IAP_FRAMES_PER_PAGE
+
+# Blocks the host keeps in flight before waiting for an ACK (0 = stop-and-wait)
+IAP_WINDOW_SIZE = 4
+window_timeout = 500
+
+# Only send the flash pages that differ from what the download slot holds
+IAP_DELTA_UPDATE = 1
+# Otherwise send the image LZSS compressed, the STM decompresses it as it arrives
+IAP_COMPRESS = 1
+# Flash every node on the bus in one transfer, each answers on its own ID
+IAP_BROADCAST = 0
+# Describe the image with a header first, the STM sizes the download from it,
+# skips an image it already runs and checks the CRC32 before switching over
+IAP_IMAGE_HEADER = 1
+FIRMWARE_VERSION = 1
+page_retries = 5
+
+def Frame_Data(frame):
+    return array('B', binascii.unhexlify(program[frame*16:(frame+1)*16]))
+
+def Page_CRC(page, total_frames):
+    first = page*Block_Frames
+    last = min((page+1)*Block_Frames, total_frames)
+    return CRC16_Block(0, binascii.unhexlify(program[first*16:last*16]))
+
+def Block_Stored(komodo_port):
+    # The status request queues behind the store, IAP_WRITE_FAILED arrives before its reply
+    Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_SEND_STATUS, array('B', []))
+    stored = True
+    for _ in range(10):
+        reply = Komodo.poll(komodo_port, longsleeptime * 1000)
+        if reply is None:
+            break
+        (can_id, data) = reply
+        if can_id != CAN_IAP_UPDATE_FIRMWARE:
+            continue
+        if len(data) == 1:
+            return stored
+        if data[0] == IAP_WRITE_FAILED:
+            stored = False
+    return False
+
+def Send_Windowed(komodo_port, start_frame):
+    total_frames = len(program)/16
+    total_pages = (total_frames + Block_Frames - 1) / Block_Frames
+    response = Komodo.request(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND, 1,\
+                              array('B', [IAP_CMD_WINDOW_START, IAP_WINDOW_SIZE, 0, 0, 0, 0]), CAN_IAP_CRC)
+    print 'Window of', IAP_WINDOW_SIZE, 'pages, target answered', response[0]
+    next_frame = start_frame
+    acked_pages = start_frame / Block_Frames
+    write_failures = 0
+    while acked_pages < total_pages:
+        # Keep the window full, each page is followed by its expected CRC
+        while next_frame < total_frames and next_frame / Block_Frames < acked_pages + IAP_WINDOW_SIZE:
+            Komodo.send(komodo_port, CAN_IAP_DATA, IAP_WRITE_TO_FLASH, Frame_Data(next_frame))
+            next_frame += 1
+            if next_frame % Block_Frames == 0 or next_frame == total_frames:
+                page = (next_frame - 1) / Block_Frames
+                crc = Page_CRC(page, total_frames)
+                Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND,\
+                            array('B', [IAP_CMD_PAGE_CHECK, page >> 8, page & 0xFF, crc >> 8, crc & 0xFF, 0]))
+                print 'Sent Page #', page, ' CRC: ', format(crc, '04X')
+        
+        reply = Komodo.poll(komodo_port, window_timeout)
+        if reply is None:
+            # Ask again for the oldest page, the target answers checks idempotently
+            crc = Page_CRC(acked_pages, total_frames)
+            Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND,\
+                        array('B', [IAP_CMD_PAGE_CHECK, acked_pages >> 8, acked_pages & 0xFF, crc >> 8, crc & 0xFF, 0]))
+            continue
+        (can_id, data) = reply
+        if can_id == CAN_IAP_UPDATE_FIRMWARE and data[0] == IAP_WRITE_FAILED:
+            # The STM rewinds to the start of the page, its NACK follows
+            write_failures += 1
+            print '!!!!!!!!! Flash Write Failed on Page #', acked_pages, '!!!!!!!!'
+            if write_failures >= page_retries:
+                Komodo.close(komodo_port)
+                sys.exit()
+            continue
+        if can_id != CAN_IAP_CRC:
+            continue
+        if data[0] == IAP_WINDOW_ACK:
+            acked_pages = max(acked_pages, (data[1] << 8) | data[2])
+            write_failures = 0
+        elif data[0] == IAP_WINDOW_NACK:
+            next_frame = (data[1] << 16) | (data[2] << 8) | data[3]
+            acked_pages = next_frame / Block_Frames
+            print '!!!!!!!!!!!! Page #', (data[4] << 8) | data[5], 'NACKed, resuming at frame', next_frame
+            Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND,\
+                        array('B', [IAP_CMD_REWIND, next_frame >> 16, (next_frame >> 8) & 0xFF, next_frame & 0xFF, 0, 0]))
+
+def Flash_Page(image, page):
+    # Contents of a flash page once written, erased flash reads back as 0xFF
+    data = image[page*FLASH_PAGE_SIZE:(page+1)*FLASH_PAGE_SIZE]
+    return data + '\xff'*(FLASH_PAGE_SIZE - len(data))
+
+def IAP_SEQUENCED_ID(page, frame):
+    return (CAN_IAP_UPDATE_FIRMWARE << IAP_SEQUENCED_ID_SHIFT) | (page << 8) | frame
+
+def Missing_Frames(komodo_port, count, nodes):
+    # Frames of the staged page any node is missing, None if the whole page has to go again.
+    # nodes is None for a single STM answering on CAN_IAP_CRC
+    Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND,\
+                array('B', [IAP_CMD_MISSING_FRAMES, count >> 8, count & 0xFF, 0, 0, 0]))
+    pending = set(nodes) if nodes else set([None])
+    missing = set()
+    resend_all = False
+    while pending:
+        reply = Komodo.poll(komodo_port, window_timeout)
+        if reply is None:
+            return None
+        (can_id, data) = reply
+        node = None if can_id == CAN_IAP_CRC else can_id - CAN_IAP_NODE_RESPONSE_BASE
+        if node not in pending or data[0] != IAP_MISSING_FRAMES:
+            continue
+        missing.update(data[2:])
+        resend_all = resend_all or data[1] > IAP_MISSING_REPORT_MAX
+        # The last frame of a node's list is shorter than 8 bytes
+        if len(data) < 8:
+            pending.discard(node)
+    return None if resend_all else sorted(missing)
+
+def Send_Page_Frames(komodo_port, page, data, nodes):
+    # Sends a flash page as sequenced frames, then only the frames that got lost
+    frames = range(len(data)/8)
+    for attempt in range(page_retries):
+        for frame in frames:
+            Komodo.send(komodo_port, IAP_SEQUENCED_ID(page, frame), IAP_WRITE_TO_FLASH,\
+                        array('B', data[frame*8:(frame+1)*8]), True)
+        frames = Missing_Frames(komodo_port, len(data)/8, nodes)
+        if frames is None:
+            frames = range(len(data)/8)
+        elif not frames:
+            return True
+        print 'Resending', len(frames), 'lost frames of Page #', page
+    return False
+
+def Send_Delta(komodo_port):
+    image = binascii.unhexlify(image_hex)
+    total_pages = (len(image) + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE
+    Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND,\
+                array('B', [IAP_CMD_PAGE_MANIFEST, 0, 0, total_pages, 0, 0]))
+    hashes = {}
+    while len(hashes) < total_pages:
+        reply = Komodo.poll(komodo_port, window_timeout)
+        if reply is None:
+            break
+        (can_id, data) = reply
+        if can_id == CAN_IAP_CRC and data[0] == IAP_PAGE_HASH:
+            hashes[(data[1] << 8) | data[2]] = (data[3] << 24) | (data[4] << 16) | (data[5] << 8) | data[6]
+    
+    sent_pages = 0
+    for page in range(total_pages):
+        if hashes.get(page) == binascii.crc32(Flash_Page(image, page)) & 0xFFFFFFFF:
+            continue
+        data = image[page*FLASH_PAGE_SIZE:(page+1)*FLASH_PAGE_SIZE]
+        crc = CRC16_Block(0, data)
+        for attempt in range(page_retries):
+            if not Send_Page_Frames(komodo_port, page, data, None):
+                print '!!!!!!!!! Page #', page, 'frames keep getting lost !!!!!!!!'
+            response = Komodo.request(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND, 1,\
+                                      array('B', [IAP_CMD_PAGE_WRITE, page >> 8, page & 0xFF, crc >> 8, crc & 0xFF, 0]),\
+                                      CAN_IAP_CRC)
+            fields = response[0].split()
+            if len(fields) >= 4 and fields[3] == format(IAP_CRC_SUCCEEDED, '02X'):
+                break
+            if len(fields) >= 4 and fields[3] == format(IAP_WRITE_FAILED, '02X'):
+                print '!!!!!!!!! Flash Write Failed on Page #', page, '!!!!!!!!'
+                Komodo.close(komodo_port)
+                sys.exit()
+            print '!!!!!!!!!!!! CRC FAILED on Page #', page, ', resending'
+        else:
+            print '!!!!!!!!! Page #', page, 'failed', page_retries, 'times !!!!!!!!'
+            Komodo.close(komodo_port)
+            sys.exit()
+        sent_pages += 1
+        print 'Sent Page #', page, ' CRC: ', format(crc, '04X')
+    print 'Delta update sent', sent_pages, 'of', total_pages, 'pages'
+
+def Send_Image_CRC32(komodo_port, image):
+    # Goes in the image header, the STM checks the slot against it on its first boot
+    crc = zlib.crc32(image) & 0xFFFFFFFF
+    Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND,\
+                array('B', [IAP_CMD_IMAGE_CRC32, crc >> 24, (crc >> 16) & 0xFF, (crc >> 8) & 0xFF, crc & 0xFF, 0]))
+    print 'Image CRC32', format(crc, '08X'), 'sent for the image header'
+
+def Send_Image_SHA256(komodo_port, image):
+    # The STM hashes the pages as they are committed and compares at IAP_PROGRAMM_END
+    digest = bytearray(hashlib.sha256(image).digest())
+    for index in range(len(digest)/4):
+        Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND,\
+                    array('B', [IAP_CMD_IMAGE_SHA256, index] + list(digest[index*4:index*4+4])))
+    print 'Image SHA-256', binascii.hexlify(digest), 'sent'
+
+def Send_Image_Header(komodo_port, image, slot, flags):
+    # One IAP_CMD_IMAGE_HEADER per word, IAP_START_HEADER then starts from it
+    crc = zlib.crc32(image) & 0xFFFFFFFF
+    words = [IAP_HEADER_MAGIC, IAP_HEADER_VERSION | (flags << 8) | (IAP_HEADER_SIZE << 16),\
+             len(image), SLOT_ADDRESSES[slot], crc, FIRMWARE_VERSION]
+    for index in range(len(words)):
+        word = words[index]
+        Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND,\
+                    array('B', [IAP_CMD_IMAGE_HEADER, index, word >> 24, (word >> 16) & 0xFF, (word >> 8) & 0xFF, word & 0xFF]))
+    print 'Image header sent, version', FIRMWARE_VERSION, 'CRC32', format(crc, '08X')
+
+def Print_Telemetry(komodo_port):
+    # One IAP_TELEMETRY frame per counter, [6] says how many there are
+    Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND,\
+                array('B', [IAP_CMD_TELEMETRY, 0, 0, 0, 0, 0]))
+    received = 0
+    values = {}
+    count = len(TELEMETRY_COUNTERS)
+    while received < count:
+        reply = Komodo.poll(komodo_port, window_timeout)
+        if reply is None:
+            print '!!!!!!!!! Telemetry incomplete,', received, 'of', count, 'counters !!!!!!!!'
+            return
+        (can_id, data) = reply
+        if can_id != CAN_IAP_CRC or data[0] != IAP_TELEMETRY:
+            continue
+        count = data[6]
+        value = (data[2] << 24) | (data[3] << 16) | (data[4] << 8) | data[5]
+        name = TELEMETRY_COUNTERS[data[1]] if data[1] < len(TELEMETRY_COUNTERS) else 'counter ' + str(data[1])
+        print '  %-22s %10d' % (name, value)
+        values[name] = value
+        received += 1
+    # What the receive interrupt costs, compare builds with CAN_RX_FAST_PATH 0 and 1
+    if values.get('RX ISR frames', 0) > 0:
+        print '  %-22s %10.1f' % ('RX ISR cycles/frame', float(values['RX ISR cycles']) / values['RX ISR frames'])
+
+def Abort_Download(signum, frame):
+    # Ctrl-C drops the download on the STM as well. It answers from the control
+    # FIFO interrupt, so the answer comes even while a page is being committed
+    Komodo.send(komodo_port, CAN_IAP_CONTROL, IAP_EXTENDED_COMMAND,\
+                array('B', [IAP_CMD_ABORT, 0, 0, 0, 0, 0]))
+    for _ in range(20):
+        reply = Komodo.poll(komodo_port, window_timeout)
+        if reply is None:
+            break
+        if reply[0] == CAN_IAP_UPDATE_FIRMWARE and reply[1][0] == IAP_ABORTED:
+            print 'Download aborted, the STM keeps running slot', download_slot ^ (IAP_SLOT_A | IAP_SLOT_B)
+            Komodo.close(komodo_port)
+            sys.exit(1)
+    print '!!!!!!!!! No answer to IAP_CMD_ABORT !!!!!!!!'
+    Komodo.close(komodo_port)
+    sys.exit(1)
+
+def Try_Resume(komodo_port):
+    # Frame an interrupted download of this same image can go on from, 0 to start over
+    response = Komodo.request(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND, 1,\
+                              array('B', [IAP_CMD_RESUME_QUERY, 0, 0, 0, 0, 0]), CAN_IAP_CRC)
+    fields = [int(field, 16) for field in response[0].split()]
+    if len(fields) < 7 or fields[0] != IAP_RESUME_STATUS:
+        return 0
+    frames = (fields[1] << 16) | (fields[2] << 8) | fields[3]
+    length = (fields[4] << 16) | (fields[5] << 8) | fields[6]
+    if frames == 0 or length != len(image_hex)/2 or frames > len(image_hex)/16:
+        return 0
+    # The committed part has to be this image, not an older one of the same size
+    crc = CRC16_Block(0, binascii.unhexlify(image_hex[:frames*16]))
+    response = Komodo.request(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND, 1,\
+                              array('B', [IAP_CMD_IMAGE_CHECK, frames >> 16, (frames >> 8) & 0xFF,\
+                                          frames & 0xFF, crc >> 8, crc & 0xFF]), CAN_IAP_CRC)
+    fields = response[0].split()
+    if len(fields) < 4 or fields[3] != format(IAP_CRC_SUCCEEDED, '02X'):
+        return 0
+    response = Komodo.request(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND, 1,\
+                              array('B', [IAP_CMD_RESUME, frames >> 16, (frames >> 8) & 0xFF, frames & 0xFF, IAP_BLOCK_PAGES, 0]),\
+                              CAN_IAP_CRC)
+    fields = [int(field, 16) for field in response[0].split()]
+    if len(fields) < 4 or fields[0] != IAP_RESUME_STATUS:
+        return 0
+    return (fields[1] << 16) | (fields[2] << 8) | fields[3]
+
+def Load_Image(slot):
+    with open(SLOT_IMAGES[slot], 'rb') as f:
+        image = binascii.hexlify(f.read())
+    # Flash is written a double word (CAN frame) at a time
+    return image + 'ff'*((-len(image)/2) % 8)
+
+def Collect_Node_Replies(komodo_port, nodes, code):
+    # First reply of every node (with payload[0] == code, any if None) until they all answered
+    replies = {}
+    while len(replies) < len(nodes):
+        reply = Komodo.poll(komodo_port, window_timeout)
+        if reply is None:
+            break
+        (can_id, data) = reply
+        node = can_id - CAN_IAP_NODE_RESPONSE_BASE
+        if node in nodes and node not in replies and len(data) > 0 and (code is None or data[0] == code):
+            replies[node] = data
+    return replies
+
+def Broadcast_Slot(komodo_port, slot, nodes):
+    image = binascii.unhexlify(Load_Image(slot))
+    total_pages = (len(image) + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE
+    print 'Broadcasting', SLOT_IMAGES[slot], 'to slot', slot, 'of nodes', nodes
+    Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_PROGRAM_START,\
+                array('B', [IAP_START_BROADCAST, len(image) >> 16, (len(image) >> 8) & 0xFF, len(image) & 0xFF, slot]))
+    replies = Collect_Node_Replies(komodo_port, nodes, None)
+    for node in nodes:
+        if node not in replies or replies[node][0] != IAP_READY:
+            print '!!!!!!!!! Node', node, 'did not start !!!!!!!!'
+    nodes = [node for node in nodes if node in replies and replies[node][0] == IAP_READY]
+    
+    # A page is sent if any node's copy of it differs from the new image
+    Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND,\
+                array('B', [IAP_CMD_PAGE_MANIFEST, 0, 0, total_pages, 0, 0]))
+    hashes = {}
+    while True:
+        reply = Komodo.poll(komodo_port, window_timeout)
+        if reply is None:
+            break
+        (can_id, data) = reply
+        if data[0] == IAP_PAGE_HASH:
+            hashes[(can_id - CAN_IAP_NODE_RESPONSE_BASE, (data[1] << 8) | data[2])] =\
+                (data[3] << 24) | (data[4] << 16) | (data[5] << 8) | data[6]
+    pages = [page for page in range(total_pages)\
+             if any(hashes.get((node, page)) != binascii.crc32(Flash_Page(image, page)) & 0xFFFFFFFF for node in nodes)]
+    
+    for page in pages:
+        data = image[page*FLASH_PAGE_SIZE:(page+1)*FLASH_PAGE_SIZE]
+        crc = CRC16_Block(0, data)
+        for attempt in range(page_retries):
+            Send_Page_Frames(komodo_port, page, data, nodes)
+            Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND,\
+                        array('B', [IAP_CMD_PAGE_WRITE, page >> 8, page & 0xFF, crc >> 8, crc & 0xFF, 0]))
+            replies = Collect_Node_Replies(komodo_port, nodes, IAP_PAGE_WRITTEN)
+            for node in nodes:
+                if node in replies and replies[node][3] == IAP_WRITE_FAILED:
+                    print '!!!!!!!!! Flash Write Failed on node', node, ', dropping it !!!!!!!!'
+            nodes = [node for node in nodes if node not in replies or replies[node][3] != IAP_WRITE_FAILED]
+            missed = [node for node in nodes if node not in replies or replies[node][3] != IAP_CRC_SUCCEEDED]
+            if not missed:
+                break
+            # Nodes that already have the page only compare it, they do not write it again
+            print '!!!!!!!!!!!! Page #', page, 'missed by nodes', missed, ', resending'
+        else:
+            print '!!!!!!!!! Page #', page, 'failed', page_retries, 'times, dropping nodes', missed, '!!!!!!!!'
+            nodes = [node for node in nodes if node not in missed]
+        print 'Sent Page #', page, ' CRC: ', format(crc, '04X')
+    print 'Broadcast', len(pages), 'of', total_pages, 'pages'
+    
+    total_frames = len(image)/8
+    image_crc = CRC16_Block(0, image)
+    Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND,\
+                array('B', [IAP_CMD_IMAGE_CHECK, total_frames >> 16, (total_frames >> 8) & 0xFF,\
+                            total_frames & 0xFF, image_crc >> 8, image_crc & 0xFF]))
+    replies = Collect_Node_Replies(komodo_port, nodes, IAP_IMAGE_CRC)
+    failed = [node for node in nodes if node not in replies or replies[node][3] != IAP_CRC_SUCCEEDED]
+    if not nodes or failed:
+        # IAP_PROGRAMM_END goes to every node, none of them switch unless all are good
+        print '!!!!!!!!!!!! IMAGE CRC FAILED on nodes', failed, ', slot', slot, 'not switched !!!!!!!!!!!'
+        return
+    print 'Image CRC ', format(image_crc, '04X'), ' verified on nodes', nodes
+    Send_Image_CRC32(komodo_port, image)
+    Send_Image_SHA256(komodo_port, image)
+    Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_LOAD_NEW_PROGRAM, array('B', [IAP_PROGRAMM_END, IAP_PROGRAMM_END]))
+    time.sleep(longsleeptime)
+
+def Broadcast_Update(komodo_port):
+    Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND,\
+                array('B', [IAP_CMD_NODE_QUERY, 0, 0, 0, 0, 0]))
+    slots = {}
+    while True:
+        reply = Komodo.poll(komodo_port, window_timeout)
+        if reply is None:
+            break
+        (can_id, data) = reply
+        if can_id > CAN_IAP_NODE_RESPONSE_BASE and can_id < CAN_IAP_NODE_RESPONSE_BASE + 128 and data[0] == IAP_NODE_INFO:
+            if data[1] in slots:
+                print '!!!!!!!!! Two nodes use node ID', data[1], ', set IAP_NODE_ID on one of them !!!!!!!!'
+            slots[data[1]] = data[2]
+            print 'Found node', data[1], 'downloading to slot', data[2]
+    # Images are linked per slot, so nodes are flashed one slot group at a time
+    for slot in sorted(set(slots.values())):
+        if slot in SLOT_IMAGES:
+            Broadcast_Slot(komodo_port, slot, sorted([node for node in slots if slots[node] == slot]))
+
 ###############################################################################
 ######################## PROGRAM CODE STARTS HERE #############################
 ###############################################################################
 
-# Send IAP_PROGRAM_START to run IAP_Start() 
-print 'Sending IAP_PROGRAM_START.....'
-response = Komodo.request(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_PROGRAM_START, 1, array('B', [3, 3, 3, 3, 3, 3, 3]), CAN_IAP_UPDATE_FIRMWARE)
-if response[0][0] + response[0][1]== format(IAP_ERASE_FAILED, '04X'): 
-    print response[0][0] + response[0][1], format(IAP_ERASE_FAILED, '04X')
-    print '!!!!!!!!! Memory Erase Failed !!!!!!!!'
+if IAP_BROADCAST:
+    Broadcast_Update(komodo_port)
+    Komodo.close(komodo_port)
+    print 'DONE'
+    sys.exit()
+
+# Ask which slot the STM will write and load the image linked for it
+response = Komodo.request(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND, 1,\
+                          array('B', [IAP_CMD_SLOT_STATUS, 0, 0, 0, 0, 0]), CAN_IAP_CRC)
+fields = response[0].split()
+if len(fields) < 3 or int(fields[2], 16) not in SLOT_IMAGES:
+    print '!!!!!!!!! No Slot Status From STM !!!!!!!!'
     Komodo.close(komodo_port)
     sys.exit()
-print 'IAP_PROGRAM_START Successful'
-time.sleep(longsleeptime)
-print 'Send Page #', IAP_handle_iteration
-while((IAP_handle_iteration + Address_in_Page) < len(program)/16):
-    # Reset the Komodo before it sends ~60 messages in a row or it will freeze
-    if komodoReset > 25:
+download_slot = int(fields[2], 16)
+print 'Active slot', int(fields[1], 16), ', downloading', SLOT_IMAGES[download_slot], 'to slot', download_slot
+program = Load_Image(download_slot)
+image_hex = program
+start_type = IAP_START_SIZED
+if IAP_DELTA_UPDATE:
+    start_type = IAP_START_DELTA
+elif IAP_COMPRESS:
+    # program is now the compressed stream, image_hex is still what ends up in flash
+    start_type = IAP_START_COMPRESSED
+    program = binascii.hexlify(LZSS_Compress(binascii.unhexlify(image_hex)))
+    program += '00'*((-len(program)/2) % 8)
+    print 'Compressed', len(image_hex)/2, 'bytes to', len(program)/2, 'bytes'
+
+# The header goes first, a resume takes the version and CRC32 from it as well
+if IAP_IMAGE_HEADER:
+    header_flags = 0
+    if start_type == IAP_START_DELTA:
+        header_flags = IAP_HEADER_DELTA
+    elif start_type == IAP_START_COMPRESSED:
+        header_flags = IAP_HEADER_COMPRESSED
+    Send_Image_Header(komodo_port, binascii.unhexlify(image_hex), download_slot, header_flags)
+
+# Only raw downloads are journaled, so only they can be picked up after a reset
+resume_frame = 0
+if start_type == IAP_START_SIZED:
+    resume_frame = Try_Resume(komodo_port)
+if resume_frame > 0:
+    print 'Resuming the interrupted download at Page #', resume_frame / Block_Frames
+else:
+    # Send IAP_PROGRAM_START with the image length to run IAP_Start(), pages are
+    # erased on the STM as they are first written so there is nothing to wait for
+    print 'Sending IAP_PROGRAM_START.....'
+    image_length = len(image_hex)/2
+    if IAP_IMAGE_HEADER:
+        response = Komodo.request(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_PROGRAM_START, 1,\
+                                  array('B', [IAP_START_HEADER, IAP_BLOCK_PAGES, 0, 0, 0]), CAN_IAP_UPDATE_FIRMWARE)
+    else:
+        response = Komodo.request(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_PROGRAM_START, 1,\
+                                  array('B', [start_type, image_length >> 16, (image_length >> 8) & 0xFF, image_length & 0xFF,\
+                                              IAP_BLOCK_PAGES]),\
+                                  CAN_IAP_UPDATE_FIRMWARE)
+    if response[0][0] + response[0][1]== format(IAP_SAME_VERSION, '02X'): 
+        print 'STM already runs version', FIRMWARE_VERSION, 'of this image, nothing to download'
         Komodo.close(komodo_port)
-        time.sleep(sleeptime)
-        komodo_port = Komodo.connect()
-        komodoReset = 0
-    else: 
-        komodoReset += 1
+        sys.exit()
+    if response[0][0] + response[0][1]== format(IAP_WRONG_SLOT, '02X'): 
+        print '!!!!!!!!! Image is not linked for slot', download_slot, '!!!!!!!!'
+        Komodo.close(komodo_port)
+        sys.exit()
+    if response[0][0] + response[0][1]== format(IAP_BAD_HEADER, '02X'): 
+        print '!!!!!!!!! Image header rejected !!!!!!!!'
+        Komodo.close(komodo_port)
+        sys.exit()
+    if response[0][0] + response[0][1]== format(IAP_ERASE_FAILED, '02X'): 
+        print '!!!!!!!!! Memory Erase Failed !!!!!!!!'
+        Komodo.close(komodo_port)
+        sys.exit()
+    if response[0][0] + response[0][1]== format(IAP_IMAGE_TOO_LARGE, '02X'): 
+        print '!!!!!!!!! Image of', image_length, 'bytes does not fit !!!!!!!!'
+        Komodo.close(komodo_port)
+        sys.exit()
+    # IAP_READY carries the block size the STM went with
+    fields = response[0].split()
+    if len(fields) > 3:
+        block_pages = int(fields[3], 16)
+        Block_Frames = block_pages * FLASH_PAGE_SIZE / 8 if block_pages else IAP_FRAMES_PER_PAGE
+    print 'IAP_PROGRAM_START Successful, blocks of', Block_Frames, 'frames'
+signal.signal(signal.SIGINT, Abort_Download)
+if IAP_DELTA_UPDATE:
+    Send_Delta(komodo_port)
+elif IAP_WINDOW_SIZE > 0:
+    Send_Windowed(komodo_port, resume_frame)
+else:
+    IAP_handle_iteration = resume_frame
+    write_failures = 0
+    print 'Send Page #', IAP_handle_iteration / Block_Frames
+    while((IAP_handle_iteration + Address_in_Page) < len(program)/16):
+        # Reset the Komodo before it sends ~60 messages in a row or it will freeze
+        if komodoReset > 25:
+            Komodo.close(komodo_port)
+            time.sleep(sleeptime)
+            komodo_port = Komodo.connect()
+            komodoReset = 0
+        else: 
+            komodoReset += 1
     
-    # Initialize the frame of program we are going to send over CAN
-    tempA = array('B', [int(program[0+((IAP_handle_iteration + Address_in_Page)*16)]  +\
-                        program[1+((IAP_handle_iteration + Address_in_Page)*16)],16),\
-                        int(program[2+((IAP_handle_iteration + Address_in_Page)*16)]  +\
-                        program[3+((IAP_handle_iteration + Address_in_Page)*16)],16),\
-                        int(program[4+((IAP_handle_iteration + Address_in_Page)*16)]  +\
-                        program[5+((IAP_handle_iteration + Address_in_Page)*16)],16),\
-                        int(program[6+((IAP_handle_iteration + Address_in_Page)*16)]  +\
-                        program[7+((IAP_handle_iteration + Address_in_Page)*16)],16),\
-                        int(program[8+((IAP_handle_iteration + Address_in_Page)*16)]  +\
-                        program[9+((IAP_handle_iteration + Address_in_Page)*16)],16),\
-                        int(program[10+((IAP_handle_iteration + Address_in_Page)*16)] +\
-                        program[11+((IAP_handle_iteration + Address_in_Page)*16)],16),\
-                        int(program[12+((IAP_handle_iteration + Address_in_Page)*16)] +\
-                        program[13+((IAP_handle_iteration + Address_in_Page)*16)],16),\
-                        int(program[14+((IAP_handle_iteration + Address_in_Page)*16)] +\
-                        program[15+((IAP_handle_iteration + Address_in_Page)*16)],16)])
+        # Initialize the frame of program we are going to send over CAN
+        tempA = array('B', [int(program[0+((IAP_handle_iteration + Address_in_Page)*16)]  +\
+                            program[1+((IAP_handle_iteration + Address_in_Page)*16)],16),\
+                            int(program[2+((IAP_handle_iteration + Address_in_Page)*16)]  +\
+                            program[3+((IAP_handle_iteration + Address_in_Page)*16)],16),\
+                            int(program[4+((IAP_handle_iteration + Address_in_Page)*16)]  +\
+                            program[5+((IAP_handle_iteration + Address_in_Page)*16)],16),\
+                            int(program[6+((IAP_handle_iteration + Address_in_Page)*16)]  +\
+                            program[7+((IAP_handle_iteration + Address_in_Page)*16)],16),\
+                            int(program[8+((IAP_handle_iteration + Address_in_Page)*16)]  +\
+                            program[9+((IAP_handle_iteration + Address_in_Page)*16)],16),\
+                            int(program[10+((IAP_handle_iteration + Address_in_Page)*16)] +\
+                            program[11+((IAP_handle_iteration + Address_in_Page)*16)],16),\
+                            int(program[12+((IAP_handle_iteration + Address_in_Page)*16)] +\
+                            program[13+((IAP_handle_iteration + Address_in_Page)*16)],16),\
+                            int(program[14+((IAP_handle_iteration + Address_in_Page)*16)] +\
+                            program[15+((IAP_handle_iteration + Address_in_Page)*16)],16)])
     
-    Program_CRC = CRC16_Calculate(Program_CRC, tempA[0])
-    Program_CRC = CRC16_Calculate(Program_CRC, tempA[1]) 
-    Program_CRC = CRC16_Calculate(Program_CRC, tempA[2])
-    Program_CRC = CRC16_Calculate(Program_CRC, tempA[3])
-    Program_CRC = CRC16_Calculate(Program_CRC, tempA[4]) 
-    Program_CRC = CRC16_Calculate(Program_CRC, tempA[5]) 
-    Program_CRC = CRC16_Calculate(Program_CRC, tempA[6])
-    Program_CRC = CRC16_Calculate(Program_CRC, tempA[7])
+        Program_CRC = CRC16_Calculate(Program_CRC, tempA[0])
+        Program_CRC = CRC16_Calculate(Program_CRC, tempA[1]) 
+        Program_CRC = CRC16_Calculate(Program_CRC, tempA[2])
+        Program_CRC = CRC16_Calculate(Program_CRC, tempA[3])
+        Program_CRC = CRC16_Calculate(Program_CRC, tempA[4]) 
+        Program_CRC = CRC16_Calculate(Program_CRC, tempA[5]) 
+        Program_CRC = CRC16_Calculate(Program_CRC, tempA[6])
+        Program_CRC = CRC16_Calculate(Program_CRC, tempA[7])
     
-    print 'Iteration:', format(IAP_handle_iteration + Address_in_Page, '04d'), ' Output: ',\
-          format(tempA[0], '02X'), format(tempA[1], '02X'), format(tempA[2], '02X'),\
-          format(tempA[3], '02X'), format(tempA[4], '02X'), format(tempA[5], '02X'), format(tempA[6], '02X'),\
-          format(tempA[7], '02X'), ' CRC: ', format(Program_CRC, '04X')
+        print 'Iteration:', format(IAP_handle_iteration + Address_in_Page, '04d'), ' Output: ',\
+              format(tempA[0], '02X'), format(tempA[1], '02X'), format(tempA[2], '02X'),\
+              format(tempA[3], '02X'), format(tempA[4], '02X'), format(tempA[5], '02X'), format(tempA[6], '02X'),\
+              format(tempA[7], '02X'), ' CRC: ', format(Program_CRC, '04X')
     
-    # Either just send the CAN frame, or send CAN frame then wait for CRC response   
-    if( (Address_in_Page < IAP_FRAMES_PER_PAGE) and ((IAP_handle_iteration + Address_in_Page) < (len(program)/16)-1) ):
-        send = Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_WRITE_TO_FLASH, tempA)        
-        Address_in_Page += 1 
+        # Either just send the CAN frame, or send CAN frame then wait for CRC response   
+        if( (Address_in_Page < Block_Frames) and ((IAP_handle_iteration + Address_in_Page) < (len(program)/16)-1) ):
+            send = Komodo.send(komodo_port, CAN_IAP_DATA, IAP_WRITE_TO_FLASH, tempA)        
+            Address_in_Page += 1 
       
-    else:
-        if (IAP_handle_iteration + Address_in_Page) == (len(program)/16)-1 :
-            send = Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_LAST_FRAME,\
-                               array('B', [IAP_LAST_FRAME, IAP_LAST_FRAME, IAP_LAST_FRAME, IAP_LAST_FRAME]))
-            time.sleep(sleeptime)
-        response = Komodo.request(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_WRITE_TO_FLASH, 1, tempA, CAN_IAP_CRC)
-        if response[0][0] + response[0][1] + response[0][3] + response[0][4] != format(Program_CRC, '04X'):
-            print 'Python CRC of ', format(Program_CRC, '04X'), ' != STM CRC of ',\
-                  str(response[0][0] + response[0][1] + response[0][3] + response[0][4])
-            print '!!!!!!!!!!!! CRC FAILED !!!!!!!!!!!'
-            send = Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_CRC_FAILED, array('B', [7, 7, 7, 7, 7, 7, 7]))
-            Address_in_Page = 0
-            time.sleep(longsleeptime)               
         else:
-            time.sleep(sleeptime)
-            send = Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_CRC_SUCCEEDED, array('B', [3, 3, 3]))
-            IAP_handle_iteration += IAP_FRAMES_PER_PAGE
-            print 'Python CRC = ', format(Program_CRC, '04X'), ' = ',\
-                  str(response[0][0] + response[0][1] + response[0][3] + response[0][4]), ' STM CRC'
-        Address_in_Page = 0
-        Program_CRC = 0
-        print ''
-        if (IAP_handle_iteration + Address_in_Page) != (len(program)/16)-1 :
-            print 'Send Page #', IAP_handle_iteration / IAP_FRAMES_PER_PAGE
-    time.sleep(sleeptime)
+            if (IAP_handle_iteration + Address_in_Page) == (len(program)/16)-1 :
+                send = Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_LAST_FRAME,\
+                                   array('B', [IAP_LAST_FRAME, IAP_LAST_FRAME, IAP_LAST_FRAME, IAP_LAST_FRAME]))
+                time.sleep(sleeptime)
+            response = Komodo.request(komodo_port, CAN_IAP_DATA, IAP_WRITE_TO_FLASH, 1, tempA, CAN_IAP_CRC)
+            if response[0][0] + response[0][1] + response[0][3] + response[0][4] != format(Program_CRC, '04X'):
+                print 'Python CRC of ', format(Program_CRC, '04X'), ' != STM CRC of ',\
+                      str(response[0][0] + response[0][1] + response[0][3] + response[0][4])
+                print '!!!!!!!!!!!! CRC FAILED !!!!!!!!!!!'
+                send = Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_CRC_FAILED, array('B', [7, 7, 7, 7, 7, 7, 7]))
+                Address_in_Page = 0
+                time.sleep(longsleeptime)               
+            else:
+                time.sleep(sleeptime)
+                send = Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_CRC_SUCCEEDED, array('B', [3, 3, 3]))
+                print 'Python CRC = ', format(Program_CRC, '04X'), ' = ',\
+                      str(response[0][0] + response[0][1] + response[0][3] + response[0][4]), ' STM CRC'
+                if Block_Stored(komodo_port):
+                    IAP_handle_iteration += Block_Frames
+                    write_failures = 0
+                else:
+                    # The STM stays on this block, send it again from its first frame
+                    write_failures += 1
+                    print '!!!!!!!!! Flash Write Failed on Page #', IAP_handle_iteration / Block_Frames, '!!!!!!!!'
+                    if write_failures >= page_retries:
+                        Komodo.close(komodo_port)
+                        sys.exit()
+            Address_in_Page = 0
+            Program_CRC = 0
+            print ''
+            if (IAP_handle_iteration + Address_in_Page) != (len(program)/16)-1 :
+                print 'Send Page #', IAP_handle_iteration / Block_Frames
+        time.sleep(sleeptime)
         
+# Check the whole image in flash before switching over to it
+total_frames = len(image_hex)/16
+image_crc = CRC16_Block(0, binascii.unhexlify(image_hex[:total_frames*16]))
+response = Komodo.request(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_EXTENDED_COMMAND, 1,\
+                          array('B', [IAP_CMD_IMAGE_CHECK, total_frames >> 16, (total_frames >> 8) & 0xFF,\
+                                      total_frames & 0xFF, image_crc >> 8, image_crc & 0xFF]), CAN_IAP_CRC)
+fields = response[0].split()
+if len(fields) < 4 or fields[3] != format(IAP_CRC_SUCCEEDED, '02X'):
+    print 'Python image CRC of ', format(image_crc, '04X'), ' != STM image CRC of ', ''.join(fields[1:3])
+    print '!!!!!!!!!!!! IMAGE CRC FAILED !!!!!!!!!!!'
+    Komodo.close(komodo_port)
+    sys.exit()
+print 'Image CRC ', format(image_crc, '04X'), ' verified'
+Send_Image_CRC32(komodo_port, binascii.unhexlify(image_hex))
+Send_Image_SHA256(komodo_port, binascii.unhexlify(image_hex))
+print 'STM telemetry:'
+Print_Telemetry(komodo_port)
+
 # Finished Sending Program | Send IAP_LOAD_NEW_PROGRAM to run IAP_Complete_Programming()
 send = Komodo.send(komodo_port, CAN_IAP_UPDATE_FIRMWARE, IAP_LOAD_NEW_PROGRAM, array('B', [IAP_PROGRAMM_END, IAP_PROGRAMM_END]))
-time.sleep(longsleeptime)
+# The STM only answers if it refuses to switch, otherwise it resets into the new slot
+reply = Komodo.poll(komodo_port, longsleeptime * 1000)
+if reply is not None and reply[0] == CAN_IAP_UPDATE_FIRMWARE:
+    if reply[1][0] == IAP_AUTH_FAILED:
+        print '!!!!!!!!!!!! IMAGE SHA-256 REJECTED, slot not switched !!!!!!!!!!!'
+    elif reply[1][0] == IAP_CRC_FAILED:
+        print '!!!!!!!!!!!! IMAGE CRC32 FAILED, slot not switched !!!!!!!!!!!'
+    elif reply[1][0] == IAP_WRONG_SLOT:
+        print '!!!!!!!!!!!! Image is not linked for slot', download_slot, ', slot not switched !!!!!!!!!!!'
+    else:
+        print '!!!!!!!!!!!! Switch over failed, status', format(reply[1][0], '02X'), '!!!!!!!!!!!'
+    Komodo.close(komodo_port)
+    sys.exit()
 Komodo.close(komodo_port)
 print 'DONE'
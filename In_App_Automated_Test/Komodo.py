@@ -61,10 +61,11 @@ def connect():
 ###############################################################################
 #########      SEND MESSAGE ON CAN                                     ########
 ###############################################################################
-def send(km, can_id, dlc, data):
+def send(km, can_id, dlc, data, extended=False):
     pkt       = km_can_packet_t()
     pkt.dlc   = dlc
     pkt.id    = can_id
+    pkt.extend_addr = 1 if extended else 0
     can_ch = KM_CAN_CH_A
     km_can_async_submit(km, can_ch, 0, pkt, data)
     return True
@@ -95,7 +96,7 @@ def request(km, can_id, dlc, response_frame_number, data_out, expected_id):
     for _ in range(10):
         for i in range(response_frame_number):
             ret = 0
-            data_in   = array('B', [0]*len(data_out))
+            data_in   = array('B', [0]*MAX_PKT_SIZE)
             while(ret == 0):
                 (ret, info, pkt, data_in) = km_can_read(km, data_in)
 
@@ -150,6 +151,19 @@ def monitor(km, max_events, timeout):
         
     return ofTheJedi
             
+###############################################################################
+#########      Waits up to timeout ms for one CAN frame, returns (id, data)
+#########      or None if nothing arrived
+###############################################################################
+def poll(km, timeout):
+    data = array('B', [0]*MAX_PKT_SIZE)
+    km_timeout(km, timeout)
+    (ret, info, pkt, data) = km_can_read(km, data)
+    km_timeout(km, 1000)
+    if ret <= 0 or info.status != KM_OK or info.events:
+        return None
+    return (pkt.id, data[:ret])
+
 ###############################################################################
 #########      CLOSE PORT                                              ########
 ###############################################################################
@@ -0,0 +1,92 @@
+# LZSS.py
+ # Author: Donovan Bidlack
+ #
+ # LZSS codec for compressed In App Programming transfers, the format the STM
+ # decodes in IAP_Decompress. A flag byte (LSB first, 1 = literal) precedes
+ # every eight tokens. A literal is one byte, a match is two: 12 bits of
+ # offset - 1 followed by 4 bits of length - LZ_MIN_MATCH.
+ # Run directly to check the codec and print the ratio of a binary file:
+ #   python LZSS.py YOURFILEHERE.bin
+
+from __future__ import print_function
+import sys
+
+LZ_WINDOW_SIZE = 4096
+LZ_MIN_MATCH = 3
+LZ_MAX_MATCH = 15 + LZ_MIN_MATCH
+LZ_MAX_CANDIDATES = 64
+
+def LZSS_Compress(data):
+    data = bytearray(data)
+    out = bytearray()
+    chains = {}
+    flags_at = 0
+    flag_bit = 8
+    i = 0
+    while i < len(data):
+        if flag_bit == 8:
+            flags_at = len(out)
+            out.append(0)
+            flag_bit = 0
+        best_length = 0
+        best_offset = 0
+        key = bytes(data[i:i+LZ_MIN_MATCH])
+        if len(key) == LZ_MIN_MATCH:
+            for start in reversed(chains.get(key, [])):
+                if i - start > LZ_WINDOW_SIZE:
+                    break
+                length = LZ_MIN_MATCH
+                while length < LZ_MAX_MATCH and i + length < len(data) and data[start + length] == data[i + length]:
+                    length += 1
+                if length > best_length:
+                    best_length = length
+                    best_offset = i - start
+                    if length == LZ_MAX_MATCH:
+                        break
+        if best_length >= LZ_MIN_MATCH:
+            out.append((best_offset - 1) >> 4)
+            out.append((((best_offset - 1) & 0x0F) << 4) | (best_length - LZ_MIN_MATCH))
+            step = best_length
+        else:
+            out[flags_at] |= 1 << flag_bit
+            out.append(data[i])
+            step = 1
+        flag_bit += 1
+        for j in range(i, i + step):
+            chain = chains.setdefault(bytes(data[j:j+LZ_MIN_MATCH]), [])
+            chain.append(j)
+            if len(chain) > LZ_MAX_CANDIDATES:
+                del chain[0]
+        i += step
+    return bytes(out)
+
+def LZSS_Decompress(data, length):
+    data = bytearray(data)
+    out = bytearray()
+    i = 0
+    while len(out) < length:
+        flags = data[i]
+        i += 1
+        for bit in range(8):
+            if len(out) >= length:
+                break
+            if flags & (1 << bit):
+                out.append(data[i])
+                i += 1
+            else:
+                offset = ((data[i] << 4) | (data[i+1] >> 4)) + 1
+                count = (data[i+1] & 0x0F) + LZ_MIN_MATCH
+                i += 2
+                for _ in range(count):
+                    out.append(out[-offset])
+    return bytes(out)
+
+if __name__ == '__main__':
+    with open(sys.argv[1], 'rb') as f:
+        image = f.read()
+    packed = LZSS_Compress(image)
+    if LZSS_Decompress(packed, len(image)) != image:
+        print('!!!!!!!!! LZSS round trip FAILED !!!!!!!!')
+        sys.exit(1)
+    print('%d -> %d bytes (%.1f%%), %d -> %d CAN frames' % (len(image), len(packed),
+          100.0 * len(packed) / len(image), (len(image) + 7) // 8, (len(packed) + 7) // 8))
@@ -16,10 +16,15 @@
 /* Includes ------------------------------------------------------------------*/
 #include "stm32l4xx_hal.h"
 #include "can.h"
+#include "crc.h"
 #include "main.h"
 
 /* IAP DEFINES*/
-#define IAP_QUEUE_BUFF_SIZE             2
+#define IAP_QUEUE_BUFF_SIZE             64    // frames, must be a power of 2
+#define IAP_QUEUE_CONTROL_RESERVE       8     // ring slots data frames may not take, kept for commands
+#define IAP_TX_QUEUE_SIZE               64    // frames, must be a power of 2, holds the longest page manifest
+#define IAP_TX_MAILBOXES                3
+#define IAP_TX_FLUSH_TIMEOUT            20    // ms IAP_CAN_Flush waits for the bus before a reset or jump
 #define IAP_TRUE                        0x12345678
 #define IAP_TX_QUEUE_ERROR              0x05
 #define IAP_RX_QUEUE_ERROR              0x04
@@ -27,6 +32,24 @@
 // CAN ID / Arbitration Field
 #define CAN_IAP_UPDATE_FIRMWARE         0x600
 #define CAN_IAP_CRC                     0x601
+#define CAN_IAP_DATA                    0x602  // IAP_WRITE_TO_FLASH frames only
+#define CAN_IAP_CONTROL                 0x603  // status, abort and bootloader jump, answered from the interrupt
+#define CAN_IAP_NODE_RESPONSE_BASE      0x680  // + node ID, answers of one node in a broadcast download
+
+// Sequenced data frames use the extended ID: CAN_IAP_UPDATE_FIRMWARE in the 
+// top 11 bits, the page in bits 8..17 and the frame within the page in 0..7
+#define IAP_SEQUENCED_ID_SHIFT          18
+#define IAP_SEQUENCED_ID( page, frame ) ( (CAN_IAP_UPDATE_FIRMWARE << IAP_SEQUENCED_ID_SHIFT) | ((page) << 8) | (frame) )
+#define IAP_IS_IAP_FRAME( pHeader )     ( (((pHeader)->IDE == CAN_ID_STD) && ((pHeader)->StdId == CAN_IAP_UPDATE_FIRMWARE)) || \
+                                          (((pHeader)->IDE == CAN_ID_STD) && ((pHeader)->StdId == CAN_IAP_DATA) && ((pHeader)->DLC == IAP_WRITE_TO_FLASH)) || \
+                                          (((pHeader)->IDE == CAN_ID_STD) && ((pHeader)->StdId == CAN_IAP_CONTROL)) || \
+                                          (((pHeader)->IDE == CAN_ID_EXT) && (((pHeader)->ExtId >> IAP_SEQUENCED_ID_SHIFT) == CAN_IAP_UPDATE_FIRMWARE)) )
+
+// Node ID (1..127) used for the broadcast response ID. 0 derives it from the
+// device unique ID, set it per node in the build to rule out collisions.
+#ifndef IAP_NODE_ID
+#define IAP_NODE_ID                     0
+#endif
 
 // CAN DLC Field Send
 #define IAP_CRC_RESPONSE                0x02
@@ -40,6 +63,7 @@
 #define IAP_CRC_SUCCEEDED               0x03
 #define IAP_CRC_FAILED                  0x07
 #define IAP_LAST_FRAME                  0x04
+#define IAP_EXTENDED_COMMAND            0x06
 
 // CAN Data Field Send
 #define IAP_ALL_GOOD                    0x0
@@ -48,14 +72,90 @@
 #define IAP_WRITE_SUCCEEDED             0x11
 #define IAP_WRITE_FAILED                0x21
 #define IAP_ERASE_FAILED                0x22
+#define IAP_IMAGE_TOO_LARGE             0x23
+#define IAP_SAME_VERSION                0x24  // header matches the running image, nothing to download
+#define IAP_WRONG_SLOT                  0x25  // header load address or reset vector is not in the download slot
+#define IAP_BAD_HEADER                  0x26  // header incomplete, or magic or version unknown
+#define IAP_AUTH_FAILED                 0x27  // SHA-256 of the slot is not the digest the host sent
+#define IAP_ABORTED                     0x28  // IAP_CMD_ABORT taken, the download slot is left as it is
 #define IAP_READY                       0xAA
 
 // CAN Data Field Receive
 #define IAP_STM_BOOTLOADER              0xAB
 #define IAP_RESET_MARKERS               0xBB
+#define IAP_START_SIZED                 0x5A  // IAP_PROGRAM_START [1..3] image length in bytes, [4] block size in pages
+#define IAP_START_DELTA                 0x5D  // IAP_PROGRAM_START [1..3] image length in bytes, changed pages only
+#define IAP_START_COMPRESSED            0x5C  // IAP_PROGRAM_START [1..3] uncompressed image length in bytes, [4] block size in pages
+#define IAP_START_BROADCAST             0x5B  // IAP_PROGRAM_START [1..3] image length in bytes, [4] download slot
+#define IAP_START_HEADER                0x59  // IAP_PROGRAM_START [1] block size in pages, the rest comes from the image header
+
+// Broadcast States
+#define IAP_BROADCAST_OFF               0x00
+#define IAP_BROADCAST_ON                0x01  // page addressed download, answers on the node response ID
+#define IAP_BROADCAST_STANDBY           0x02  // broadcast for the other slot, frames are ignored
+
+// Transfer Modes
+#define IAP_TRANSFER_RAW                0x00
+#define IAP_TRANSFER_DELTA              0x01  // page addressed, see IAP_Write_Flash_Page
+#define IAP_TRANSFER_COMPRESSED         0x02  // LZSS stream, see IAP_Decompress
+
+// IAP_EXTENDED_COMMAND Sub-Commands (RxMessage[0])
+#define IAP_CMD_WINDOW_START            0x10  // [1] window size in transfer blocks
+#define IAP_CMD_PAGE_CHECK              0x11  // [1..2] transfer block, [3..4] expected CRC16
+#define IAP_CMD_REWIND                  0x12  // [1..3] frame the host resumes from
+#define IAP_CMD_IMAGE_CHECK             0x13  // [1..3] image length in frames, [4..5] expected CRC16
+#define IAP_CMD_CRC_BENCH               0x14  // [1..4] xorshift32 seed, [5] length in frames (0 = one flash page)
+#define IAP_CMD_QUEUE_STATUS            0x15
+#define IAP_CMD_SLOT_STATUS             0x16
+#define IAP_CMD_PAGE_MANIFEST           0x17  // [1..2] first flash page, [3] number of pages (0 = rest of slot)
+#define IAP_CMD_PAGE_WRITE              0x18  // [1..2] flash page, [3..4] CRC16 of the staged frames
+#define IAP_CMD_NODE_QUERY              0x19
+#define IAP_CMD_MISSING_FRAMES          0x1A  // [1..2] number of frames sent for the page being staged
+#define IAP_CMD_RESUME_QUERY            0x1B
+#define IAP_CMD_RESUME                  0x1C  // [1..3] frame to resume from, as reported by IAP_RESUME_STATUS, [4] block size in pages
+#define IAP_CMD_IMAGE_CRC32             0x1D  // [1..4] CRC32 of the whole image, checked on the first boot into it
+#define IAP_CMD_BOOT_TIMING             0x1E  // [1] boot phase
+#define IAP_CMD_TELEMETRY               0x1F  // [1] 1 = clear the counters once they are sent
+#define IAP_CMD_IMAGE_HEADER            0x20  // [1] word of IAP_Image_Header, [2..5] its value
+#define IAP_CMD_IMAGE_SHA256            0x21  // [1] word of the SHA-256 digest (0..7), [2..5] its value
+#define IAP_CMD_ABORT                   0x22  // on CAN_IAP_CONTROL, drops the download in progress, never switched to
+
+// Sliding Window Responses on CAN_IAP_CRC (payload[0])
+#define IAP_WINDOW_ACK                  0xA0  // [1..2] next expected transfer block
+#define IAP_WINDOW_NACK                 0xA1  // [1..3] frame to resume from, [4..5] failed transfer block
+#define IAP_IMAGE_CRC                   0xA2  // [1..2] CRC16 of the image, [3] CRC succeeded/failed
+#define IAP_CRC_BENCH                   0xA3  // [1] engine, [2..3] CRC16, [4..7] DWT cycles
+#define IAP_QUEUE_STATUS                0xA4  // [1..2] ring overruns, [3..4] data FIFO overruns, [5] ring high water, [6] control FIFO overruns, [7] transmit ring overruns (both saturate at 255)
+#define IAP_SLOT_STATUS                 0xA5  // [1] active slot, [2] download slot, [3..4] slot size in pages
+#define IAP_PAGE_HASH                   0xA6  // [1..2] flash page, [3..6] CRC32 of the page in the download slot
+#define IAP_PAGE_WRITTEN                0xA7  // [1..2] flash page, [3] CRC succeeded/failed or write failed
+#define IAP_NODE_INFO                   0xA8  // [1] node ID, [2] download slot, [3..6] CRC32 of the unique ID
+#define IAP_MISSING_FRAMES              0xA9  // [1] frames missing (saturates at 255), [2..7] up to 6 missing frames
+#define IAP_MISSING_REPORT_MAX          30    // missing frames listed, past this the host resends the page
+#define IAP_RESUME_STATUS               0xAC  // [1..3] frames committed (0 = nothing to resume), [4..6] image length
+#define IAP_BOOT_TIMING                 0xAD  // [1] boot phase, [2..5] DWT cycles from reset, [6] core clock in MHz
+#define IAP_TELEMETRY                   0xAE  // [1] counter, [2..5] value, [6] number of counters, one frame each
+
+// CRC16 Engines
+#define IAP_CRC_ENGINE_TABLE            0x01  // IAP_Calculate_CRC16, one byte per step
+#define IAP_CRC_ENGINE_SLICE_BY_8       0x02  // IAP_CRC16_Software
+#define IAP_CRC_ENGINE_HARDWARE         0x03  // IAP_CRC16_Block, CRC peripheral
+#define IAP_CRC_ENGINE_SHA256           0x04  // IAP_SHA256_Update, [2..3] are the first digest bytes
+#define IAP_WINDOW_MAX                  8
 
 // Flash Memory
 #define IAP_APPLICATION_ADDRESS         (uint32_t)0x08008000
+#define IAP_APPLICATION_END             IAP_FLASH_VAR_START_LOCATION
+
+// A/B Application Slots. Each image is linked for the slot it is loaded into,
+// downloads always go to the slot that is not running.
+#define IAP_SLOT_SIZE                   ( (IAP_APPLICATION_END - IAP_APPLICATION_ADDRESS) / 2 )  // 54 pages
+#define IAP_SLOT_A_ADDRESS              IAP_APPLICATION_ADDRESS                                // 0x08008000
+#define IAP_SLOT_B_ADDRESS              ( IAP_SLOT_A_ADDRESS + IAP_SLOT_SIZE )                 // 0x08023000
+#define IAP_SLOT_PAGES                  ( IAP_SLOT_SIZE / FLASH_PAGE_SIZE )
+#define IAP_SLOT_NONE                   0x00
+#define IAP_SLOT_A                      0x01
+#define IAP_SLOT_B                      0x02
 
 // STM32L432KC Specific
 #define FLASH_START_ADDRESS             0x08000000
@@ -63,15 +163,188 @@
 #define FLASH_BANK_NUMBER               2
 #define PAGE_ERASE_SUCCESS              0xFFFFFFFF
 #define IAP_FLASH_VAR_START_LOCATION    0x0803E000
-#define IAP_START_IAP_PROCESS           0x0803E000
-#define IAP_IS_PROGRAMMED               0x0803E004
+#define IAP_MARKER_LOG_A                0x0803E000  // marker log, one flash page
+#define IAP_MARKER_LOG_B                0x0803F000  // marker log once page A is full, and back
+#define IAP_IS_PROGRAMMED               0x0803E004  // markers before the marker log, still booted
 #define IAP_FLASHED_PROGRAM_LOCATION    0x0803E008
+#define IAP_VALID_TOKEN                 0x56414C44
+#define IAP_JOURNAL_START               0x0803E800  // progress journal, one flash page
+#define IAP_JOURNAL_END                 ( IAP_JOURNAL_START + FLASH_PAGE_SIZE )
 #define IAP_STM_BOOTLOADER_LOCATION     0x1FFF0000
-#define IAP_FRAMES_PER_PAGE             250  // 2000 bytes per page / 8 bytes per CAN frame
+#define IAP_FRAMES_PER_PAGE             250  // 2000 byte transfer pages of hosts that do not ask for a block size
+#define IAP_FLASH_ROW_SIZE              256  // 32 double words, fast programming unit
+#define IAP_FLASH_ROW_FRAMES            ( IAP_FLASH_ROW_SIZE / 8 )
+#define IAP_ERASE_AHEAD_PAGES           1    // flash pages erased in the background past the page being received
+
+// Running During Flash Operations. Flash reads stall while it is erased or
+// programmed, so the vector table, the CAN receive path (stm32l4xx_hal_can.o
+// and stm32l4xx_it.o, see the linker file) and the flash routines run from
+// RAM with interrupts left enabled. Interrupts still in flash get a lower
+// priority than CAN (0) and are held off during a fast programming row.
+#define IAP_VECTOR_TABLE_SIZE           ( 16 + CRS_IRQn + 1 )
+#define IAP_VECTOR_TABLE_ALIGN          512
+#define IAP_FLASH_IRQ_PRIORITY          1    // also TICK_INT_PRIORITY
+#define IAP_FLASH_BASEPRI               ( IAP_FLASH_IRQ_PRIORITY << (8 - __NVIC_PRIO_BITS) )
+
+// Transfer Blocks, what the host sends between two CRC checks. The host asks
+// for 1 to IAP_BLOCK_PAGES_MAX flash pages at IAP_PROGRAM_START, so a block
+// always starts and ends on a flash page and a block that fails to commit is
+// erased and written again on its own. Bigger blocks mean fewer CRC round 
+// trips. Hosts that ask for 0 keep the old IAP_FRAMES_PER_PAGE blocks.
+#define IAP_BLOCK_PAGES_MAX             8
+#define IAP_PAGE_BUFFER_FRAMES          ( FLASH_PAGE_SIZE / 8 )  // one flash page, delta updates
+
+// Block Staging Buffer. Holds the largest transfer block plus the frame the 
+// stop-and-wait host sends with its CRC request (the first frame of the next
+// block). It no longer fits in SRAM2 next to the decompression output, which
+// stays in IAP_STAGING_SECTION.
+#define IAP_STAGING_SECTION             ".sram2"
+#define IAP_BLOCK_BUFFER_FRAMES         ( IAP_BLOCK_PAGES_MAX * IAP_PAGE_BUFFER_FRAMES + 1 )
+
+// LZSS Compressed Images. A flag byte (LSB first, 1 = literal) precedes every
+// eight tokens, a literal is one byte and a match two: 12 bits of offset - 1
+// then 4 bits of length - IAP_LZ_MIN_MATCH. Matches are copied from the image
+// already written, so no window buffer is needed.
+#define IAP_LZ_WINDOW_SIZE              4096
+#define IAP_LZ_MIN_MATCH                3
+#define IAP_LZ_MAX_MATCH                ( 15 + IAP_LZ_MIN_MATCH )
+
+// Marker Log Records, appended by every update, the newest committed one
+// says which slot boots. A log page is only erased when the log moves to it,
+// the other page still holds the active record until the new one commits.
+#define IAP_MARKER_RECORD_SIZE          40
+#define IAP_MARKER_SLOT                 0     // slot address, then sequence number
+#define IAP_MARKER_HEADER               8     // image length, then its CRC32
+#define IAP_MARKER_VERSION              16    // firmware version (IAP_VERSION_UNKNOWN without a header)
+#define IAP_MARKER_TOKEN                24    // IAP_VALID_TOKEN, then the CRC32, on the first boot
+#define IAP_MARKER_COMMITTED            32    // IAP_MARKER_COMMIT, then IAP_TRUE, written last
+#define IAP_MARKER_COMMIT               0x4D524B43
+
+// Image Header, sent a word at a time with IAP_CMD_IMAGE_HEADER before an
+// IAP_START_HEADER. It sizes the download, picks the transfer mode, lets the
+// IAP skip an image it already runs and checks the CRC32 before switching.
+#define IAP_HEADER_MAGIC                0x49415048
+#define IAP_HEADER_VERSION              1
+#define IAP_HEADER_WORDS                ( sizeof(IAP_Image_Header) / 4 )
+#define IAP_HEADER_COMPRESSED           0x01  // LZSS stream, see IAP_TRANSFER_COMPRESSED
+#define IAP_HEADER_DELTA                0x02  // changed pages only, see IAP_TRANSFER_DELTA
+#define IAP_VERSION_UNKNOWN             0xFFFFFFFF
+
+// Image Authentication. The SHA-256 of the slot is fed from flash as pages
+// are committed in order, so IAP_PROGRAMM_END only hashes what was not (the
+// pages a delta update left alone) before comparing it to the digest the host
+// sent. Set IAP_REQUIRE_SHA256 to 1 in the build to refuse images without one.
+#ifndef IAP_REQUIRE_SHA256
+#define IAP_REQUIRE_SHA256              0
+#endif
+#define IAP_SHA256_BLOCK_SIZE           64
+#define IAP_SHA256_DIGEST_SIZE          32
+#define IAP_SHA256_WORDS                ( IAP_SHA256_DIGEST_SIZE / 4 )
+#define IAP_ROTR( x, n )                ( ((x) >> (n)) | ((x) << (32 - (n))) )
+#define IAP_SHA256_CH( x, y, z )        ( ((x) & (y)) ^ (~(x) & (z)) )
+#define IAP_SHA256_MAJ( x, y, z )       ( ((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)) )
+#define IAP_SHA256_EP0( x )             ( IAP_ROTR(x, 2) ^ IAP_ROTR(x, 13) ^ IAP_ROTR(x, 22) )
+#define IAP_SHA256_EP1( x )             ( IAP_ROTR(x, 6) ^ IAP_ROTR(x, 11) ^ IAP_ROTR(x, 25) )
+#define IAP_SHA256_SIG0( x )            ( IAP_ROTR(x, 7) ^ IAP_ROTR(x, 18) ^ ((x) >> 3) )
+#define IAP_SHA256_SIG1( x )            ( IAP_ROTR(x, 17) ^ IAP_ROTR(x, 19) ^ ((x) >> 10) )
+
+// Progress Journal Records, one double word each: tag in the low word, value
+// in the high word. Appended as a raw download commits pages, erased when the
+// next download starts.
+#define IAP_JOURNAL_TRANSFER            0x4A524E01  // (download slot << 24) | image length
+#define IAP_JOURNAL_PAGE                0x4A524E02  // frames committed
+#define IAP_JOURNAL_DONE                0x4A524E03  // switched over, nothing to resume
+
+// Boot Timing. SystemInit starts the DWT cycle counter at reset and each
+// phase records the count it ended at, in the last 64 bytes of SRAM2 so the
+// application can read the timings of the boot that started it. Phases that
+// did not run this boot read 0.
+#define IAP_BOOT_TIMING_LOCATION        0x2000FFC0
+#define IAP_BOOT_TIMING_MAGIC           0x424F4F54
+#define IAP_BOOT_MAIN                   0     // SystemInit and C startup, reset to main
+#define IAP_BOOT_CHECKS                 1     // markers, vector table and image checks
+#define IAP_BOOT_JUMP                   2     // HAL_DeInit, ends at JumpToApplication
+#define IAP_BOOT_HAL_INIT               3     // staying in the IAP: HAL_Init
+#define IAP_BOOT_CLOCK                  4     // SystemClock_Config
+#define IAP_BOOT_READY                  5     // peripherals, IAP_init and CAN start
+#define IAP_BOOT_PHASES                 6
+
+// Telemetry Counters, kept since IAP_init and sent with IAP_CMD_TELEMETRY.
+// Cycle counts are DWT cycles the main loop spent blocked on that work.
+#define IAP_TELEMETRY_FRAMES_RECEIVED   0
+#define IAP_TELEMETRY_QUEUE_OVERRUNS    1
+#define IAP_TELEMETRY_FIFO_OVERRUNS     2     // data FIFO (FIFO0)
+#define IAP_TELEMETRY_PROGRAM_RETRIES   3
+#define IAP_TELEMETRY_ERASE_RETRIES     4
+#define IAP_TELEMETRY_CRC_FAILURES      5     // page CRCs that did not match
+#define IAP_TELEMETRY_ERASE_CYCLES      6     // erases and waiting for background erases
+#define IAP_TELEMETRY_PROGRAM_CYCLES    7
+#define IAP_TELEMETRY_CRC_CYCLES        8     // page CRCs of received frames
+#define IAP_TELEMETRY_LAST_ERROR        9     // last failing IAP_Status, IAP_Status itself is reset per frame
+#define IAP_TELEMETRY_HASH_CYCLES       10    // SHA-256 of committed pages and what was left at the end
+#define IAP_TELEMETRY_CONTROL_HITS      11    // frames let in by each acceptance filter
+#define IAP_TELEMETRY_DATA_HITS         12
+#define IAP_TELEMETRY_SEQUENCED_HITS    13
+#define IAP_TELEMETRY_CONTROL_OVERRUNS  14    // control FIFO (FIFO1)
+#define IAP_TELEMETRY_TX_OVERRUNS       15    // answers dropped because the transmit ring was full
+#define IAP_TELEMETRY_RX_ISR_CYCLES     16    // spent in the CAN RX interrupts, see CAN_RX_FAST_PATH
+#define IAP_TELEMETRY_RX_ISR_FRAMES     17    // frames those interrupts read
+#define IAP_TELEMETRY_COMMAND_HITS      18    // CAN_IAP_UPDATE_FIRMWARE frames, the control hits are CAN_IAP_CONTROL
+#define IAP_TELEMETRY_COUNTERS          19
 
 /* IAP Types -----------------------------------------------------------------*/
 typedef  void (*pFunction)( void );
 
+typedef struct
+{
+  CAN_RxHeaderTypeDef Header;
+  uint8_t Data[8];
+} IAP_Frame;
+
+typedef struct
+{
+  uint16_t StdId;
+  uint8_t DLC;
+  uint8_t Data[8];
+} IAP_Tx_Frame;
+
+typedef struct
+{
+  uint32_t Magic;                       // IAP_HEADER_MAGIC
+  uint8_t Header_Version;               // IAP_HEADER_VERSION
+  uint8_t Flags;                        // IAP_HEADER_COMPRESSED, IAP_HEADER_DELTA
+  uint16_t Header_Size;                 // bytes, sizeof(IAP_Image_Header) for version 1
+  uint32_t Image_Length;                // bytes as they end up in flash
+  uint32_t Load_Address;                // slot the image is linked for
+  uint32_t Image_CRC32;                 // of the Image_Length bytes in flash
+  uint32_t Firmware_Version;
+} IAP_Image_Header;
+
+typedef struct
+{
+  uint32_t State[8];
+  uint32_t Length;                      // bytes fed so far
+  uint32_t Block[IAP_SHA256_BLOCK_SIZE / 4];  // partial block, Fill bytes of it
+  uint8_t Fill;
+} IAP_SHA256_Context;
+
+typedef struct
+{
+  uint32_t Magic;                       // IAP_BOOT_TIMING_MAGIC once this boot is recorded
+  uint32_t Cycles[IAP_BOOT_PHASES];     // DWT cycles from reset at the end of each phase
+  uint8_t MHz[IAP_BOOT_PHASES];         // core clock each phase ended at
+} IAP_Boot_Timing;
+
+typedef struct
+{
+  uint32_t Output_Page;
+  uint16_t Output_Fill;                 // bytes of the page kept in Output_Saved
+  uint8_t Flags;
+  uint8_t Flag_Count;
+  uint8_t Token;
+  uint8_t Have_Token;
+} IAP_LZ_State;
+
 /* Function Prototypes  ------------------------------------------------------*/
 
 /**********************************************
@@ -83,6 +356,85 @@ typedef  void (*pFunction)( void );
 **********************************************/
 void IAP_Status_Check( void );
 
+/**********************************************
+  Name: IAP_Boot_Timing_Start
+  Description: starts the boot timing record of
+        this boot and marks the end of 
+        IAP_BOOT_MAIN.
+**********************************************/
+void IAP_Boot_Timing_Start( void );
+
+/**********************************************
+  Name: IAP_Boot_Mark
+  Description: records the DWT cycle count and 
+        core clock at the end of a boot phase.
+**********************************************/
+void IAP_Boot_Mark( uint8_t phase );
+
+/**********************************************
+  Name: IAP_Validate_Image
+  Description: checks the image in the slot at
+        location against the length and CRC32 of
+        its image header once, on the first boot
+        after an update, and writes the validity
+        token if it matches. Boots after that 
+        only look for the token.
+**********************************************/
+HAL_StatusTypeDef IAP_Validate_Image( uint32_t location );
+
+/**********************************************
+  Name: IAP_Marker_Active
+  Description: returns the address of the 
+        committed marker record with the highest
+        sequence number in either log page, or 0
+        if there is none.
+**********************************************/
+uint32_t IAP_Marker_Active( void );
+
+/**********************************************
+  Name: IAP_Marker_Next
+  Description: returns where the next record of
+        the log page at page goes, past the last
+        record that was started, or 0 if the 
+        page is full.
+**********************************************/
+uint32_t IAP_Marker_Next( uint32_t page );
+
+/**********************************************
+  Name: IAP_Marker_Append
+  Description: appends a record that boots the
+        slot at slot, holding the image length,
+        CRC32 and firmware version. The record 
+        only counts once its commit double word,
+        written last, is in. A full log page moves the log to the
+        other page, erasing that one first.
+**********************************************/
+HAL_StatusTypeDef IAP_Marker_Append( uint32_t slot, uint32_t length, uint32_t crc, uint32_t version );
+
+/**********************************************
+  Name: IAP_Active_Slot
+  Description: returns the start address of the
+        slot the active marker record says to 
+        boot, or 0 if there is no programmed 
+        slot.
+**********************************************/
+uint32_t IAP_Active_Slot( void );
+
+/**********************************************
+  Name: IAP_Inactive_Slot
+  Description: returns the start address of the
+        slot a download is written to, the one
+        that is not active.
+**********************************************/
+uint32_t IAP_Inactive_Slot( void );
+
+/**********************************************
+  Name: IAP_Slot_Number
+  Description: converts a slot start address to
+        IAP_SLOT_A, IAP_SLOT_B or IAP_SLOT_NONE.
+**********************************************/
+uint8_t IAP_Slot_Number( uint32_t address );
+
 /**********************************************
   Name: IAP_init
   Description: initialized the IAP_handle for
@@ -108,33 +460,169 @@ void IAP_Start_STM_Bootloader( void );
 **********************************************/
 HAL_StatusTypeDef IAP_Route_Messages( CAN_RxHeaderTypeDef *pHeader, uint8_t RxMessage[] );
 
+/**********************************************
+  Name: IAP_Queue_Frame
+  Description: called from the CAN RX interrupt.
+        Copies the frame into the receive ring 
+        for IAP_Process_Queue and returns right
+        away. Counts an overrun and drops the 
+        frame if the ring is full, data frames 
+        leave the last IAP_QUEUE_CONTROL_RESERVE
+        slots to commands. Runs from RAM
+        so frames are queued while flash is busy.
+**********************************************/
+__ramfunc HAL_StatusTypeDef IAP_Queue_Frame( CAN_RxHeaderTypeDef *pHeader, uint8_t RxMessage[] );
+
+/**********************************************
+  Name: IAP_Process_Queue
+  Description: called from the main loop. Passes
+        every queued frame to IAP_Route_Messages
+        so flash programming, erases and CRCs 
+        run outside of interrupt context, and 
+        carries out a pending IAP_CMD_ABORT or 
+        bootloader jump from CAN_IAP_CONTROL.
+**********************************************/
+void IAP_Process_Queue( void );
+
+/**********************************************
+  Name: IAP_Count_FIFO_Overrun
+  Description: called when the CAN hardware RX 
+        FIFO RxFifo overran and a frame was lost 
+        before the interrupt could queue it.
+        The data and control FIFOs are counted
+        apart.
+**********************************************/
+__ramfunc void IAP_Count_FIFO_Overrun( uint32_t RxFifo );
+
+/**********************************************
+  Name: IAP_Control_Frame
+  Description: called from the control FIFO 
+        interrupt for CAN_IAP_CONTROL frames. 
+        IAP_SEND_STATUS, IAP_CMD_QUEUE_STATUS 
+        and IAP_CMD_ABORT are answered right 
+        here, so they are not held up by a page
+        being committed or by the data queued 
+        ahead of them. IAP_STM_BOOTLOADER is 
+        taken by the main loop before any 
+        queued frame. Other commands are 
+        ignored on this ID, they have to stay 
+        in order with the data. Returns 0 if 
+        the frame is not a CAN_IAP_CONTROL 
+        frame and has to be queued. Runs from 
+        RAM.
+**********************************************/
+__ramfunc uint8_t IAP_Control_Frame( CAN_RxHeaderTypeDef *pHeader, uint8_t RxMessage[] );
+
+/**********************************************
+  Name: IAP_Abort_Transfer
+  Description: called from IAP_Process_Queue 
+        after an IAP_CMD_ABORT. Drops the 
+        frames queued before the abort and the 
+        download in progress, data still in 
+        flight is discarded until the next 
+        IAP_PROGRAM_START. Returns the new ring
+        tail.
+**********************************************/
+uint16_t IAP_Abort_Transfer( void );
+
 /**********************************************
   Name: IAP_Start
-  Description: initialized the IAP_handle for
-        In app programming. uses a rtos queue
-        to signal the inapp programming that 
-        is desired
+  Description: starts the IAP process for an 
+        image of imageLength bytes (0 if the 
+        host did not send it) in the inactive
+        slot, the running image and the slot it
+        runs from are never touched. Nothing is erased
+        here, IAP_Commit_Page erases each flash
+        page just before its first write (or in
+        the background one page ahead), so the
+        host is told IAP_READY straight away, 
+        with the transfer block size it got.
+        mode is one of the IAP_TRANSFER modes.
 **********************************************/
-HAL_StatusTypeDef IAP_Start( void );
+HAL_StatusTypeDef IAP_Start( uint32_t imageLength, uint8_t mode, uint8_t blockPages );
+
+/**********************************************
+  Name: IAP_Block_Size
+  Description: sets the transfer block to 
+        blockPages flash pages, at most 
+        IAP_BLOCK_PAGES_MAX, or to the old 
+        IAP_FRAMES_PER_PAGE frames for 0. 
+        Returns the block size in pages that 
+        was taken.
+**********************************************/
+uint8_t IAP_Block_Size( uint8_t blockPages );
+
+/**********************************************
+  Name: IAP_Start_From_Header
+  Description: starts a download described by 
+        the image header the host sent. Answers
+        IAP_SAME_VERSION instead if the active 
+        slot already holds that version and 
+        CRC32, IAP_WRONG_SLOT if the image is 
+        not linked for the download slot and 
+        IAP_BAD_HEADER if the header is not 
+        complete or not understood. Transfer
+        blocks are blockPages flash pages.
+**********************************************/
+HAL_StatusTypeDef IAP_Start_From_Header( uint8_t blockPages );
 
 /**********************************************
   Name: IAP_Complete_Programming
   Description: After CAN messages have completed
         (the IAP_PROGRAMM_END payload was sent
         over the CAN) this method is called to 
-        update the program pointer to the new
-        program location and finalizes the 
-        programming.
+        append a marker record for the slot that
+        was just written and reset into it. The
+        old slot is left intact. The record's 
+        image header holds the CRC32 the host sent with 
+        IAP_CMD_IMAGE_CRC32 or in the image 
+        header, which the slot has to match, or
+        the one of the slot as written for hosts
+        that send neither. The slot also has to
+        match the SHA-256 digest the host sent.
+        A slot whose reset vector points outside
+        of it is refused with IAP_WRONG_SLOT.
 **********************************************/
 HAL_StatusTypeDef IAP_Complete_Programming( void );
 
 /**********************************************
   Name: IAP_Calculate_CRC_for_Memory_Frame
-  Description: computes the CRC of a CAN frame
-            after it has been written to memory
-            (computes it from read memory).
+  Description: computes the CRC of NbrOfFrames
+            CAN frames after they have been 
+            written to memory (computes it from
+            read memory).
+**********************************************/
+void IAP_Calculate_CRC_for_Memory_Frame( uint32_t Address, uint16_t NbrOfFrames );
+
+/**********************************************
+  Name: IAP_CRC16_Block
+  Description: continues a CRC16_CCITT_ZERO 
+        (XModem) over length bytes at p_data.
+        Runs on the CRC peripheral when it has
+        been initialized, otherwise falls back 
+        to IAP_CRC16_Software.
+**********************************************/
+uint16_t IAP_CRC16_Block( uint16_t crc, uint8_t *p_data, uint32_t length );
+
+/**********************************************
+  Name: IAP_Window_Page_Check
+  Description: sliding window mode. Compares the
+        CRC of the page currently being written
+        with the CRC the host expects and sends
+        a cumulative ACK, or rewinds and NACKs
+        the page.
 **********************************************/
-void IAP_Calculate_CRC_for_Memory_Frame( uint32_t Address );
+void IAP_Window_Page_Check( uint16_t page, uint16_t expectedCRC );
+
+/**********************************************
+  Name: IAP_Window_Rewind
+  Description: sliding window mode. Drops the
+        staged page and tells the host to resume
+        from the start of it. Data frames are 
+        discarded until the host answers with 
+        IAP_CMD_REWIND.
+**********************************************/
+void IAP_Window_Rewind( void );
 
 /**********************************************
   Name: IAP_Calculate_CRC16
@@ -147,6 +635,101 @@ void IAP_Calculate_CRC_for_Memory_Frame( uint32_t Address );
 **********************************************/
 uint16_t IAP_Calculate_CRC16( uint16_t crc, uint8_t data );
 
+/**********************************************
+  Name: IAP_CRC16_Software
+  Description: software CRC16_CCITT_ZERO over
+        length bytes, eight bytes per step 
+        (slicing-by-8) with the remainder done 
+        a byte at a time.
+**********************************************/
+uint16_t IAP_CRC16_Software( uint16_t crc, const uint8_t *p_data, uint32_t length );
+
+/**********************************************
+  Name: IAP_CRC32
+  Description: continues a CRC32 (IEEE 802.3, 
+        the zlib crc32) over length bytes at 
+        p_data, a byte at a time.
+**********************************************/
+uint32_t IAP_CRC32( uint32_t crc, const uint8_t *p_data, uint32_t length );
+
+/**********************************************
+  Name: IAP_SHA256_Init
+  Description: starts a SHA-256 over nothing.
+**********************************************/
+void IAP_SHA256_Init( IAP_SHA256_Context *p_context );
+
+/**********************************************
+  Name: IAP_SHA256_Update
+  Description: continues a SHA-256 over length
+        bytes at p_data. Whole blocks are 
+        hashed in place, only the bytes of a
+        partial block are copied.
+**********************************************/
+void IAP_SHA256_Update( IAP_SHA256_Context *p_context, const uint8_t *p_data, uint32_t length );
+
+/**********************************************
+  Name: IAP_SHA256_Final
+  Description: pads the SHA-256 and writes the
+        digest, big-endian, to p_digest. The 
+        context has to be started again after.
+**********************************************/
+void IAP_SHA256_Final( IAP_SHA256_Context *p_context, uint8_t *p_digest );
+
+/**********************************************
+  Name: IAP_SHA256_Transform
+  Description: hashes the 64 byte block at 
+        p_block into state.
+**********************************************/
+void IAP_SHA256_Transform( uint32_t *state, const uint8_t *p_block );
+
+/**********************************************
+  Name: IAP_Hash_Committed
+  Description: feeds the image SHA-256 with the
+        flash of the download slot from where it
+        stopped up to end, if the page just 
+        committed at destination continues it.
+        A page committed again behind it starts
+        the hash over.
+**********************************************/
+void IAP_Hash_Committed( uint32_t destination, uint32_t end );
+
+/**********************************************
+  Name: IAP_Send_Page_Manifest
+  Description: delta updates. Sends the CRC32 of
+        NbrOfPages flash pages of the download
+        slot from first, one IAP_PAGE_HASH frame
+        per page, so the host can leave out the 
+        pages that already match the new image.
+**********************************************/
+void IAP_Send_Page_Manifest( uint16_t first, uint16_t NbrOfPages );
+
+/**********************************************
+  Name: IAP_Write_Flash_Page
+  Description: delta updates. Checks the CRC of
+        the frames staged for flash page 
+        page of the download slot, then erases,
+        programs and verifies just that page and
+        answers with IAP_PAGE_WRITTEN. Only the
+        page being staged is written, and only 
+        once every frame of it has arrived. A 
+        page that already holds the staged 
+        frames is not written again (broadcast
+        resends).
+**********************************************/
+void IAP_Write_Flash_Page( uint16_t page, uint16_t expectedCRC );
+
+/**********************************************
+  Name: IAP_CRC_Benchmark
+  Description: fills the staging buffer with 
+        NbrOfFrames frames of xorshift32 data 
+        from seed and reports the CRC and DWT
+        cycle count of every CRC16 engine and of
+        the SHA-256, one CAN_IAP_CRC frame each. 0
+        frames is a whole flash page. Only to be
+        used while no page is being staged.
+**********************************************/
+void IAP_CRC_Benchmark( uint32_t seed, uint16_t NbrOfFrames );
+
 /**********************************************
   Name: IAP_WriteFrameToFlash
   Description: Receives CAN message and writes
@@ -155,14 +738,235 @@ uint16_t IAP_Calculate_CRC16( uint16_t crc, uint8_t data );
 **********************************************/
 HAL_StatusTypeDef IAP_WriteFrameToFlash( uint32_t destination, uint32_t *p_source, uint32_t *p_source2 );
 
+/**********************************************
+  Name: IAP_Commit_Page
+  Description: programs NbrOfFrames staged frames
+        to flash at destination with a single
+        unlock. Whole 32 double-word rows are 
+        written with fast programming, the rest
+        one double-word at a time. The result is
+        read back and compared to the source. 
+        Stops at the first failed write, the 
+        caller erases and commits again.
+**********************************************/
+HAL_StatusTypeDef IAP_Commit_Page( uint32_t destination, uint64_t *p_source, uint16_t NbrOfFrames );
+
+/**********************************************
+  Name: IAP_Store_Page
+  Description: writes the transfer block at 
+        iteration once its CRC was accepted. Raw
+        images are committed as they are, 
+        compressed ones go through 
+        IAP_Decompress. A raw block that fails
+        to commit is erased, just its own flash
+        pages, and written once more. A 
+        compressed block that fails leaves the 
+        decoder where the block started, so the
+        host can resend it.
+**********************************************/
+HAL_StatusTypeDef IAP_Store_Page( uint16_t NbrOfFrames );
+
+/**********************************************
+  Name: IAP_Decompress
+  Description: compressed transfers. Decodes 
+        length bytes of the LZSS stream into the
+        output buffer, committing each flash 
+        page as it fills and the last one when
+        the image length is reached. Decoder 
+        state is kept between calls so tokens 
+        may be split across transfer pages.
+**********************************************/
+HAL_StatusTypeDef IAP_Decompress( const uint8_t *p_data, uint32_t length );
+
+/**********************************************
+  Name: IAP_Decompress_Output
+  Description: appends one decoded byte to the
+        output buffer and commits the buffer
+        when it holds a whole flash page or the
+        end of the image. A whole page that 
+        failed to commit stays in the buffer and
+        is committed before anything is added.
+**********************************************/
+HAL_StatusTypeDef IAP_Decompress_Output( uint8_t value );
+
+/**********************************************
+  Name: IAP_Decompress_Commit
+  Description: commits the output buffer to its
+        flash page, erasing the page and writing
+        it once more if that fails, and moves on
+        to the next page once a whole one is in.
+**********************************************/
+HAL_StatusTypeDef IAP_Decompress_Commit( void );
+
+/**********************************************
+  Name: IAP_Decompress_Save
+  Description: compressed transfers. Keeps the
+        decoder state and the partly filled 
+        output page from before a block, for 
+        IAP_Decompress_Restore.
+**********************************************/
+void IAP_Decompress_Save( void );
+
+/**********************************************
+  Name: IAP_Decompress_Restore
+  Description: compressed transfers. Puts the 
+        decoder back where it was before the 
+        block that failed and erases the flash
+        pages that block wrote, so the resent 
+        block is decoded into them again.
+**********************************************/
+HAL_StatusTypeDef IAP_Decompress_Restore( void );
+
+/**********************************************
+  Name: IAP_Send_Node_Info
+  Description: broadcast downloads. Answers a 
+        node query with the node ID, download 
+        slot and unique ID hash on this node's
+        response ID, so the host can find every
+        node on the bus.
+**********************************************/
+void IAP_Send_Node_Info( void );
+
+/**********************************************
+  Name: IAP_Stage_Sequenced_Frame
+  Description: stages a data frame that carries
+        its page and frame index in the extended
+        ID at that index, and marks it received
+        so lost frames can be resent on their 
+        own. A frame for another page clears the
+        received bitmap and starts the page over.
+**********************************************/
+void IAP_Stage_Sequenced_Frame( uint32_t extId, uint8_t RxMessage[] );
+
+/**********************************************
+  Name: IAP_Send_Missing_Frames
+  Description: lists the frames below 
+        NbrOfFrames that have not been received
+        for the page being staged, up to 6 per
+        IAP_MISSING_FRAMES frame.
+**********************************************/
+void IAP_Send_Missing_Frames( uint16_t NbrOfFrames );
+
+/**********************************************
+  Name: IAP_Frames_Received
+  Description: returns 1 if every frame below 
+        NbrOfFrames of the page being staged has
+        been received, 0 otherwise.
+**********************************************/
+uint8_t IAP_Frames_Received( uint16_t NbrOfFrames );
+
+/**********************************************
+  Name: IAP_Clear_Received
+  Description: starts a new page, no frame of it
+        has been received yet.
+**********************************************/
+void IAP_Clear_Received( void );
+
+/**********************************************
+  Name: IAP_Send_Telemetry
+  Description: sends every telemetry counter, 
+        one IAP_TELEMETRY frame each, and clears
+        them afterwards if clear is 1.
+**********************************************/
+void IAP_Send_Telemetry( uint8_t clear );
+
+/**********************************************
+  Name: IAP_Journal_Scan
+  Description: reads the progress journal after
+        a reset to find the download that was 
+        interrupted, if any, and where the next
+        record goes.
+**********************************************/
+void IAP_Journal_Scan( void );
+
+/**********************************************
+  Name: IAP_Journal_Append
+  Description: appends one record to the 
+        progress journal. Does nothing once the
+        journal page is full or a record could 
+        not be written.
+**********************************************/
+HAL_StatusTypeDef IAP_Journal_Append( uint32_t tag, uint32_t value );
+
+/**********************************************
+  Name: IAP_Resume
+  Description: continues the interrupted raw 
+        download from frame, which has to be 
+        the committed progress read from the 
+        journal, with transfer blocks of 
+        blockPages flash pages. Answers with 
+        IAP_RESUME_STATUS holding the frame it 
+        resumes from, 0 if the download has to 
+        start over.
+**********************************************/
+void IAP_Resume( uint32_t frame, uint8_t blockPages );
+
+/**********************************************
+  Name: IAP_Erase_Ahead
+  Description: makes sure flash is erased up to
+        end before it is programmed, erasing 
+        only the pages this transfer has not 
+        already erased. Refuses to go past the
+        end of the image.
+**********************************************/
+HAL_StatusTypeDef IAP_Erase_Ahead( uint32_t end );
+
+/**********************************************
+  Name: IAP_Erase_Next_Page_IT
+  Description: starts an interrupt driven erase
+        of the next unerased flash page of the
+        image, as long as it is no more than 
+        IAP_ERASE_AHEAD_PAGES past the page 
+        being received. Returns straight away, 
+        the flash interrupt finishes the erase.
+**********************************************/
+void IAP_Erase_Next_Page_IT( void );
+
+/**********************************************
+  Name: IAP_Wait_For_Erase
+  Description: blocks until a background erase
+        started by IAP_Erase_Next_Page_IT has
+        finished so flash can be used again.
+**********************************************/
+void IAP_Wait_For_Erase( void );
+
 /**********************************************
   Name: IAP_Erase_Flash_Memory
   Description: erases user memory from start for NbrOfPages
-        length, pausing all other
-        tasks to ensure data integrity.
+        length, a page at a time from RAM so the
+        CAN receive interrupt keeps running.
 **********************************************/
 HAL_StatusTypeDef IAP_Erase_Flash_Memory( uint32_t start, uint8_t NbrOfPages );
 
+/**********************************************
+  Name: IAP_Flash_Erase_Page
+  Description: erases the flash page at address
+        from RAM, polling BSY with interrupts 
+        enabled, and resets the flash caches 
+        afterwards as HAL_FLASHEx_Erase does.
+        Flash has to be unlocked.
+**********************************************/
+__ramfunc HAL_StatusTypeDef IAP_Flash_Erase_Page( uint32_t address );
+
+/**********************************************
+  Name: IAP_Flash_Program
+  Description: programs one double word from 
+        RAM, polling BSY with interrupts enabled.
+        Flash has to be unlocked.
+**********************************************/
+__ramfunc HAL_StatusTypeDef IAP_Flash_Program( uint32_t address, uint64_t data );
+
+/**********************************************
+  Name: IAP_Flash_Program_Row
+  Description: fast programs one 32 double word
+        row from RAM. A late double word aborts
+        the row, so only interrupts above 
+        IAP_FLASH_BASEPRI (CAN, running from RAM)
+        are taken while it is written. Flash has
+        to be unlocked.
+**********************************************/
+__ramfunc HAL_StatusTypeDef IAP_Flash_Program_Row( uint32_t address, const uint64_t *p_source );
+
 /**********************************************
   Name: IAP_Reset_IAP_Markers
   Description: resets the IAP Markers that tell
@@ -173,8 +977,38 @@ HAL_StatusTypeDef IAP_Reset_IAP_Markers( void );
 
 /**********************************************
   Name: IAP_CAN_Send
-  Description: Sends one CAN frame
+  Description: Queues one CAN frame in the 
+        transmit ring and returns without 
+        waiting for a mailbox, the frame is 
+        dropped and counted if the ring is 
+        full. During a broadcast download the 
+        IAP answers go out on this node's 
+        response ID. Runs from RAM, 
+        IAP_Control_Frame answers from the CAN
+        interrupt.
+**********************************************/
+__ramfunc void IAP_CAN_Send( uint16_t standardID, uint8_t ide, uint8_t payload[8], uint8_t dlc );
+
+/**********************************************
+  Name: IAP_CAN_Drain_Tx
+  Description: moves frames from the transmit 
+        ring into the free TX mailboxes. Called
+        by IAP_CAN_Send and from the mailbox 
+        complete interrupts, so all three 
+        mailboxes stay busy while answers are 
+        queued. Callers in thread mode mask 
+        interrupts around it. Runs from RAM.
+**********************************************/
+__ramfunc void IAP_CAN_Drain_Tx( void );
+
+/**********************************************
+  Name: IAP_CAN_Flush
+  Description: waits until the transmit ring 
+        and the TX mailboxes are empty, at most
+        IAP_TX_FLUSH_TIMEOUT ms. Called before 
+        a reset or a jump so the last answers 
+        still go out.
 **********************************************/
-void IAP_CAN_Send( uint16_t standardID, uint8_t ide, uint8_t payload[8], uint8_t dlc );
+void IAP_CAN_Flush( void );
 
 #endif /* __IN_APP_PRGRM__ */
\ No newline at end of file
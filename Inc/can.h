@@ -33,13 +33,53 @@
 extern CAN_HandleTypeDef hcan1;
 
 /* USER CODE BEGIN Private defines */
+// IAP Acceptance Filters. Only IAP frames get past the hardware, so other 
+// traffic on the bus never interrupts. Commands (CAN_IAP_UPDATE_FIRMWARE) share
+// FIFO0 with the data (CAN_IAP_DATA and sequenced frames) so they stay in bus
+// order with it. FIFO1 only takes CAN_IAP_CONTROL, the commands answered from
+// the interrupt.
+#define CAN_FILTER_BANK_CONTROL         0     // 16-bit ID list, CAN_IAP_CONTROL
+#define CAN_FILTER_BANK_DATA            1     // 16-bit ID list, CAN_IAP_UPDATE_FIRMWARE and CAN_IAP_DATA
+#define CAN_FILTER_BANK_SEQUENCED       2     // 32-bit ID mask, extended IDs of IAP_SEQUENCED_ID
+#define CAN_FILTER_STD( id )            ( (id) << 5 )  // 16-bit filter element of a standard data frame
 
+// Filter match index of each filter in its FIFO. Each FIFO numbers the filter
+// elements assigned to it in bank order: 4 per 16-bit list (FR1 low, FR1 high,
+// FR2 low, FR2 high), 1 per 32-bit mask.
+#define CAN_FMI_CONTROL                 0     // FIFO1, 0..3
+#define CAN_FMI_COMMAND                 0     // FIFO0, 0..1
+#define CAN_FMI_DATA                    2     // FIFO0, 2..3
+#define CAN_FMI_SEQUENCED               4     // FIFO0
+
+// Hit Counters, one per filter
+#define CAN_FILTER_CONTROL              0
+#define CAN_FILTER_DATA                 1
+#define CAN_FILTER_SEQUENCED            2
+#define CAN_FILTER_COMMAND              3
+#define CAN_FILTER_UNKNOWN              4     // match index not one of the above
+#define CAN_FILTERS                     5
+
+extern volatile uint32_t CAN_Filter_Hits[CAN_FILTERS];
+
+// 1 drains the RX FIFOs in CAN1_Rx_Drain straight from the registers and 
+// refills the TX mailboxes in CAN1_Tx_Complete, 0 goes through 
+// HAL_CAN_IRQHandler and one HAL_CAN_GetRxMessage per interrupt. Both count 
+// their DWT cycles in CAN_Rx_ISR_Cycles, for comparing the two.
+#ifndef CAN_RX_FAST_PATH
+#define CAN_RX_FAST_PATH                1
+#endif
+
+extern volatile uint32_t CAN_Rx_ISR_Cycles;   // spent in the CAN RX interrupts
+extern volatile uint32_t CAN_Rx_ISR_Frames;   // frames read from the RX FIFOs
 /* USER CODE END Private defines */
 
 void MX_CAN1_Init(void);
 
 /* USER CODE BEGIN Prototypes */
-
+HAL_StatusTypeDef CAN1_Filter_Init(void);
+void CAN_Count_Filter_Hit(uint32_t RxFifo, uint32_t FilterMatchIndex);
+void CAN1_Rx_Drain(uint32_t RxFifo);
+void CAN1_Tx_Complete(void);
 /* USER CODE END Prototypes */
 
 #ifdef __cplusplus
@@ -9,6 +9,7 @@
 ********************************************************************************/
 
 #include "IAP.h"
+#include <string.h>
 
 // Global Variables
 uint8_t IAP_Status;
@@ -16,6 +17,427 @@ uint16_t Program_CRC;
 uint16_t Address_in_Page;
 uint8_t Is_Last_Frame;
 uint32_t iteration;
+uint8_t Window_Size;
+uint8_t Window_Discard;
+uint16_t Block_Frames;
+uint32_t Slot_Address;
+uint32_t Image_End;
+uint32_t Image_CRC32;
+uint8_t Image_CRC32_Set;
+uint32_t Image_Version;
+IAP_Image_Header Image_Header;
+uint8_t Image_Header_Words;
+IAP_SHA256_Context Image_Hash;
+uint32_t Hash_Up_To;
+uint8_t Image_SHA256[IAP_SHA256_DIGEST_SIZE];
+uint8_t Image_SHA256_Words;
+volatile uint32_t Erased_Up_To;
+uint8_t Transfer_Mode;
+uint8_t Broadcast;
+uint8_t Node_ID;
+uint32_t Node_UID_Hash;
+uint32_t Rx_Bitmap[IAP_PAGE_BUFFER_FRAMES / 32];
+uint16_t Seq_Page;
+uint32_t Journal_Next;
+uint32_t Resume_Frames;
+uint32_t Resume_Length;
+uint8_t Resume_Slot;
+uint32_t Output_Page;
+uint16_t Output_Fill;
+uint8_t LZ_Flags;
+uint8_t LZ_Flag_Count;
+uint8_t LZ_Token;
+uint8_t LZ_Have_Token;
+IAP_LZ_State LZ_Saved;
+volatile uint8_t Erase_Busy;
+volatile uint8_t Erase_Error;
+uint32_t Erase_Page_Address;
+
+// Receive Ring, single producer (CAN RX interrupt) single consumer (main loop)
+IAP_Frame IAP_Rx_Queue[IAP_QUEUE_BUFF_SIZE];
+volatile uint16_t IAP_Rx_Head;
+volatile uint16_t IAP_Rx_Tail;
+uint16_t IAP_Rx_Queue_Overruns;
+uint16_t IAP_Rx_FIFO_Overruns;
+uint16_t IAP_Rx_Control_Overruns;
+uint8_t IAP_Rx_High_Water;
+volatile uint8_t Abort_Pending;
+volatile uint8_t Bootloader_Pending;
+uint16_t Abort_Head;
+
+// Transmit Ring, filled by IAP_CAN_Send and drained into the TX mailboxes
+IAP_Tx_Frame IAP_Tx_Queue[IAP_TX_QUEUE_SIZE];
+volatile uint16_t IAP_Tx_Head;
+volatile uint16_t IAP_Tx_Tail;
+uint16_t IAP_Tx_Queue_Overruns;
+uint32_t Telemetry[IAP_TELEMETRY_COUNTERS];
+
+// Block Staging Buffer, frames are gathered here and committed to flash once
+// the block CRC has been accepted
+__no_init uint64_t Page_Buffer[IAP_BLOCK_BUFFER_FRAMES];
+
+// Decompressed output of a compressed transfer, one flash page
+#pragma location = IAP_STAGING_SECTION
+__no_init uint64_t Output_Buffer[FLASH_PAGE_SIZE / 8];
+
+// Output buffer as it was before the block being decoded, see IAP_Decompress_Save
+#pragma location = IAP_STAGING_SECTION
+__no_init uint64_t Output_Saved[FLASH_PAGE_SIZE / 8];
+
+// Vector table copy, interrupts are taken from RAM while flash is busy
+#pragma data_alignment = IAP_VECTOR_TABLE_ALIGN
+__no_init uint32_t IAP_Vector_Table[IAP_VECTOR_TABLE_SIZE];
+
+// Boot Timing, at a fixed address that survives the jump to the application
+#pragma location = IAP_BOOT_TIMING_LOCATION
+__no_init IAP_Boot_Timing Boot_Timing;
+
+// CRC16_CCITT_ZERO (XModem) slicing-by-8 tables. IAP_CRC16_Table[0] is the
+// byte-at-a-time table, IAP_CRC16_Table[k] is table 0 advanced by k zero bytes.
+const uint16_t IAP_CRC16_Table[8][256] =
+{
+  {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+    0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+    0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+    0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+    0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+    0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+    0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+    0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+    0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+    0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+    0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+    0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+    0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+    0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+    0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+    0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+    0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+    0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+    0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+    0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+    0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+    0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+  },
+  {
+    0x0000, 0x3331, 0x6662, 0x5553, 0xCCC4, 0xFFF5, 0xAAA6, 0x9997,
+    0x89A9, 0xBA98, 0xEFCB, 0xDCFA, 0x456D, 0x765C, 0x230F, 0x103E,
+    0x0373, 0x3042, 0x6511, 0x5620, 0xCFB7, 0xFC86, 0xA9D5, 0x9AE4,
+    0x8ADA, 0xB9EB, 0xECB8, 0xDF89, 0x461E, 0x752F, 0x207C, 0x134D,
+    0x06E6, 0x35D7, 0x6084, 0x53B5, 0xCA22, 0xF913, 0xAC40, 0x9F71,
+    0x8F4F, 0xBC7E, 0xE92D, 0xDA1C, 0x438B, 0x70BA, 0x25E9, 0x16D8,
+    0x0595, 0x36A4, 0x63F7, 0x50C6, 0xC951, 0xFA60, 0xAF33, 0x9C02,
+    0x8C3C, 0xBF0D, 0xEA5E, 0xD96F, 0x40F8, 0x73C9, 0x269A, 0x15AB,
+    0x0DCC, 0x3EFD, 0x6BAE, 0x589F, 0xC108, 0xF239, 0xA76A, 0x945B,
+    0x8465, 0xB754, 0xE207, 0xD136, 0x48A1, 0x7B90, 0x2EC3, 0x1DF2,
+    0x0EBF, 0x3D8E, 0x68DD, 0x5BEC, 0xC27B, 0xF14A, 0xA419, 0x9728,
+    0x8716, 0xB427, 0xE174, 0xD245, 0x4BD2, 0x78E3, 0x2DB0, 0x1E81,
+    0x0B2A, 0x381B, 0x6D48, 0x5E79, 0xC7EE, 0xF4DF, 0xA18C, 0x92BD,
+    0x8283, 0xB1B2, 0xE4E1, 0xD7D0, 0x4E47, 0x7D76, 0x2825, 0x1B14,
+    0x0859, 0x3B68, 0x6E3B, 0x5D0A, 0xC49D, 0xF7AC, 0xA2FF, 0x91CE,
+    0x81F0, 0xB2C1, 0xE792, 0xD4A3, 0x4D34, 0x7E05, 0x2B56, 0x1867,
+    0x1B98, 0x28A9, 0x7DFA, 0x4ECB, 0xD75C, 0xE46D, 0xB13E, 0x820F,
+    0x9231, 0xA100, 0xF453, 0xC762, 0x5EF5, 0x6DC4, 0x3897, 0x0BA6,
+    0x18EB, 0x2BDA, 0x7E89, 0x4DB8, 0xD42F, 0xE71E, 0xB24D, 0x817C,
+    0x9142, 0xA273, 0xF720, 0xC411, 0x5D86, 0x6EB7, 0x3BE4, 0x08D5,
+    0x1D7E, 0x2E4F, 0x7B1C, 0x482D, 0xD1BA, 0xE28B, 0xB7D8, 0x84E9,
+    0x94D7, 0xA7E6, 0xF2B5, 0xC184, 0x5813, 0x6B22, 0x3E71, 0x0D40,
+    0x1E0D, 0x2D3C, 0x786F, 0x4B5E, 0xD2C9, 0xE1F8, 0xB4AB, 0x879A,
+    0x97A4, 0xA495, 0xF1C6, 0xC2F7, 0x5B60, 0x6851, 0x3D02, 0x0E33,
+    0x1654, 0x2565, 0x7036, 0x4307, 0xDA90, 0xE9A1, 0xBCF2, 0x8FC3,
+    0x9FFD, 0xACCC, 0xF99F, 0xCAAE, 0x5339, 0x6008, 0x355B, 0x066A,
+    0x1527, 0x2616, 0x7345, 0x4074, 0xD9E3, 0xEAD2, 0xBF81, 0x8CB0,
+    0x9C8E, 0xAFBF, 0xFAEC, 0xC9DD, 0x504A, 0x637B, 0x3628, 0x0519,
+    0x10B2, 0x2383, 0x76D0, 0x45E1, 0xDC76, 0xEF47, 0xBA14, 0x8925,
+    0x991B, 0xAA2A, 0xFF79, 0xCC48, 0x55DF, 0x66EE, 0x33BD, 0x008C,
+    0x13C1, 0x20F0, 0x75A3, 0x4692, 0xDF05, 0xEC34, 0xB967, 0x8A56,
+    0x9A68, 0xA959, 0xFC0A, 0xCF3B, 0x56AC, 0x659D, 0x30CE, 0x03FF
+  },
+  {
+    0x0000, 0x3730, 0x6E60, 0x5950, 0xDCC0, 0xEBF0, 0xB2A0, 0x8590,
+    0xA9A1, 0x9E91, 0xC7C1, 0xF0F1, 0x7561, 0x4251, 0x1B01, 0x2C31,
+    0x4363, 0x7453, 0x2D03, 0x1A33, 0x9FA3, 0xA893, 0xF1C3, 0xC6F3,
+    0xEAC2, 0xDDF2, 0x84A2, 0xB392, 0x3602, 0x0132, 0x5862, 0x6F52,
+    0x86C6, 0xB1F6, 0xE8A6, 0xDF96, 0x5A06, 0x6D36, 0x3466, 0x0356,
+    0x2F67, 0x1857, 0x4107, 0x7637, 0xF3A7, 0xC497, 0x9DC7, 0xAAF7,
+    0xC5A5, 0xF295, 0xABC5, 0x9CF5, 0x1965, 0x2E55, 0x7705, 0x4035,
+    0x6C04, 0x5B34, 0x0264, 0x3554, 0xB0C4, 0x87F4, 0xDEA4, 0xE994,
+    0x1DAD, 0x2A9D, 0x73CD, 0x44FD, 0xC16D, 0xF65D, 0xAF0D, 0x983D,
+    0xB40C, 0x833C, 0xDA6C, 0xED5C, 0x68CC, 0x5FFC, 0x06AC, 0x319C,
+    0x5ECE, 0x69FE, 0x30AE, 0x079E, 0x820E, 0xB53E, 0xEC6E, 0xDB5E,
+    0xF76F, 0xC05F, 0x990F, 0xAE3F, 0x2BAF, 0x1C9F, 0x45CF, 0x72FF,
+    0x9B6B, 0xAC5B, 0xF50B, 0xC23B, 0x47AB, 0x709B, 0x29CB, 0x1EFB,
+    0x32CA, 0x05FA, 0x5CAA, 0x6B9A, 0xEE0A, 0xD93A, 0x806A, 0xB75A,
+    0xD808, 0xEF38, 0xB668, 0x8158, 0x04C8, 0x33F8, 0x6AA8, 0x5D98,
+    0x71A9, 0x4699, 0x1FC9, 0x28F9, 0xAD69, 0x9A59, 0xC309, 0xF439,
+    0x3B5A, 0x0C6A, 0x553A, 0x620A, 0xE79A, 0xD0AA, 0x89FA, 0xBECA,
+    0x92FB, 0xA5CB, 0xFC9B, 0xCBAB, 0x4E3B, 0x790B, 0x205B, 0x176B,
+    0x7839, 0x4F09, 0x1659, 0x2169, 0xA4F9, 0x93C9, 0xCA99, 0xFDA9,
+    0xD198, 0xE6A8, 0xBFF8, 0x88C8, 0x0D58, 0x3A68, 0x6338, 0x5408,
+    0xBD9C, 0x8AAC, 0xD3FC, 0xE4CC, 0x615C, 0x566C, 0x0F3C, 0x380C,
+    0x143D, 0x230D, 0x7A5D, 0x4D6D, 0xC8FD, 0xFFCD, 0xA69D, 0x91AD,
+    0xFEFF, 0xC9CF, 0x909F, 0xA7AF, 0x223F, 0x150F, 0x4C5F, 0x7B6F,
+    0x575E, 0x606E, 0x393E, 0x0E0E, 0x8B9E, 0xBCAE, 0xE5FE, 0xD2CE,
+    0x26F7, 0x11C7, 0x4897, 0x7FA7, 0xFA37, 0xCD07, 0x9457, 0xA367,
+    0x8F56, 0xB866, 0xE136, 0xD606, 0x5396, 0x64A6, 0x3DF6, 0x0AC6,
+    0x6594, 0x52A4, 0x0BF4, 0x3CC4, 0xB954, 0x8E64, 0xD734, 0xE004,
+    0xCC35, 0xFB05, 0xA255, 0x9565, 0x10F5, 0x27C5, 0x7E95, 0x49A5,
+    0xA031, 0x9701, 0xCE51, 0xF961, 0x7CF1, 0x4BC1, 0x1291, 0x25A1,
+    0x0990, 0x3EA0, 0x67F0, 0x50C0, 0xD550, 0xE260, 0xBB30, 0x8C00,
+    0xE352, 0xD462, 0x8D32, 0xBA02, 0x3F92, 0x08A2, 0x51F2, 0x66C2,
+    0x4AF3, 0x7DC3, 0x2493, 0x13A3, 0x9633, 0xA103, 0xF853, 0xCF63
+  },
+  {
+    0x0000, 0x76B4, 0xED68, 0x9BDC, 0xCAF1, 0xBC45, 0x2799, 0x512D,
+    0x85C3, 0xF377, 0x68AB, 0x1E1F, 0x4F32, 0x3986, 0xA25A, 0xD4EE,
+    0x1BA7, 0x6D13, 0xF6CF, 0x807B, 0xD156, 0xA7E2, 0x3C3E, 0x4A8A,
+    0x9E64, 0xE8D0, 0x730C, 0x05B8, 0x5495, 0x2221, 0xB9FD, 0xCF49,
+    0x374E, 0x41FA, 0xDA26, 0xAC92, 0xFDBF, 0x8B0B, 0x10D7, 0x6663,
+    0xB28D, 0xC439, 0x5FE5, 0x2951, 0x787C, 0x0EC8, 0x9514, 0xE3A0,
+    0x2CE9, 0x5A5D, 0xC181, 0xB735, 0xE618, 0x90AC, 0x0B70, 0x7DC4,
+    0xA92A, 0xDF9E, 0x4442, 0x32F6, 0x63DB, 0x156F, 0x8EB3, 0xF807,
+    0x6E9C, 0x1828, 0x83F4, 0xF540, 0xA46D, 0xD2D9, 0x4905, 0x3FB1,
+    0xEB5F, 0x9DEB, 0x0637, 0x7083, 0x21AE, 0x571A, 0xCCC6, 0xBA72,
+    0x753B, 0x038F, 0x9853, 0xEEE7, 0xBFCA, 0xC97E, 0x52A2, 0x2416,
+    0xF0F8, 0x864C, 0x1D90, 0x6B24, 0x3A09, 0x4CBD, 0xD761, 0xA1D5,
+    0x59D2, 0x2F66, 0xB4BA, 0xC20E, 0x9323, 0xE597, 0x7E4B, 0x08FF,
+    0xDC11, 0xAAA5, 0x3179, 0x47CD, 0x16E0, 0x6054, 0xFB88, 0x8D3C,
+    0x4275, 0x34C1, 0xAF1D, 0xD9A9, 0x8884, 0xFE30, 0x65EC, 0x1358,
+    0xC7B6, 0xB102, 0x2ADE, 0x5C6A, 0x0D47, 0x7BF3, 0xE02F, 0x969B,
+    0xDD38, 0xAB8C, 0x3050, 0x46E4, 0x17C9, 0x617D, 0xFAA1, 0x8C15,
+    0x58FB, 0x2E4F, 0xB593, 0xC327, 0x920A, 0xE4BE, 0x7F62, 0x09D6,
+    0xC69F, 0xB02B, 0x2BF7, 0x5D43, 0x0C6E, 0x7ADA, 0xE106, 0x97B2,
+    0x435C, 0x35E8, 0xAE34, 0xD880, 0x89AD, 0xFF19, 0x64C5, 0x1271,
+    0xEA76, 0x9CC2, 0x071E, 0x71AA, 0x2087, 0x5633, 0xCDEF, 0xBB5B,
+    0x6FB5, 0x1901, 0x82DD, 0xF469, 0xA544, 0xD3F0, 0x482C, 0x3E98,
+    0xF1D1, 0x8765, 0x1CB9, 0x6A0D, 0x3B20, 0x4D94, 0xD648, 0xA0FC,
+    0x7412, 0x02A6, 0x997A, 0xEFCE, 0xBEE3, 0xC857, 0x538B, 0x253F,
+    0xB3A4, 0xC510, 0x5ECC, 0x2878, 0x7955, 0x0FE1, 0x943D, 0xE289,
+    0x3667, 0x40D3, 0xDB0F, 0xADBB, 0xFC96, 0x8A22, 0x11FE, 0x674A,
+    0xA803, 0xDEB7, 0x456B, 0x33DF, 0x62F2, 0x1446, 0x8F9A, 0xF92E,
+    0x2DC0, 0x5B74, 0xC0A8, 0xB61C, 0xE731, 0x9185, 0x0A59, 0x7CED,
+    0x84EA, 0xF25E, 0x6982, 0x1F36, 0x4E1B, 0x38AF, 0xA373, 0xD5C7,
+    0x0129, 0x779D, 0xEC41, 0x9AF5, 0xCBD8, 0xBD6C, 0x26B0, 0x5004,
+    0x9F4D, 0xE9F9, 0x7225, 0x0491, 0x55BC, 0x2308, 0xB8D4, 0xCE60,
+    0x1A8E, 0x6C3A, 0xF7E6, 0x8152, 0xD07F, 0xA6CB, 0x3D17, 0x4BA3
+  },
+  {
+    0x0000, 0xAA51, 0x4483, 0xEED2, 0x8906, 0x2357, 0xCD85, 0x67D4,
+    0x022D, 0xA87C, 0x46AE, 0xECFF, 0x8B2B, 0x217A, 0xCFA8, 0x65F9,
+    0x045A, 0xAE0B, 0x40D9, 0xEA88, 0x8D5C, 0x270D, 0xC9DF, 0x638E,
+    0x0677, 0xAC26, 0x42F4, 0xE8A5, 0x8F71, 0x2520, 0xCBF2, 0x61A3,
+    0x08B4, 0xA2E5, 0x4C37, 0xE666, 0x81B2, 0x2BE3, 0xC531, 0x6F60,
+    0x0A99, 0xA0C8, 0x4E1A, 0xE44B, 0x839F, 0x29CE, 0xC71C, 0x6D4D,
+    0x0CEE, 0xA6BF, 0x486D, 0xE23C, 0x85E8, 0x2FB9, 0xC16B, 0x6B3A,
+    0x0EC3, 0xA492, 0x4A40, 0xE011, 0x87C5, 0x2D94, 0xC346, 0x6917,
+    0x1168, 0xBB39, 0x55EB, 0xFFBA, 0x986E, 0x323F, 0xDCED, 0x76BC,
+    0x1345, 0xB914, 0x57C6, 0xFD97, 0x9A43, 0x3012, 0xDEC0, 0x7491,
+    0x1532, 0xBF63, 0x51B1, 0xFBE0, 0x9C34, 0x3665, 0xD8B7, 0x72E6,
+    0x171F, 0xBD4E, 0x539C, 0xF9CD, 0x9E19, 0x3448, 0xDA9A, 0x70CB,
+    0x19DC, 0xB38D, 0x5D5F, 0xF70E, 0x90DA, 0x3A8B, 0xD459, 0x7E08,
+    0x1BF1, 0xB1A0, 0x5F72, 0xF523, 0x92F7, 0x38A6, 0xD674, 0x7C25,
+    0x1D86, 0xB7D7, 0x5905, 0xF354, 0x9480, 0x3ED1, 0xD003, 0x7A52,
+    0x1FAB, 0xB5FA, 0x5B28, 0xF179, 0x96AD, 0x3CFC, 0xD22E, 0x787F,
+    0x22D0, 0x8881, 0x6653, 0xCC02, 0xABD6, 0x0187, 0xEF55, 0x4504,
+    0x20FD, 0x8AAC, 0x647E, 0xCE2F, 0xA9FB, 0x03AA, 0xED78, 0x4729,
+    0x268A, 0x8CDB, 0x6209, 0xC858, 0xAF8C, 0x05DD, 0xEB0F, 0x415E,
+    0x24A7, 0x8EF6, 0x6024, 0xCA75, 0xADA1, 0x07F0, 0xE922, 0x4373,
+    0x2A64, 0x8035, 0x6EE7, 0xC4B6, 0xA362, 0x0933, 0xE7E1, 0x4DB0,
+    0x2849, 0x8218, 0x6CCA, 0xC69B, 0xA14F, 0x0B1E, 0xE5CC, 0x4F9D,
+    0x2E3E, 0x846F, 0x6ABD, 0xC0EC, 0xA738, 0x0D69, 0xE3BB, 0x49EA,
+    0x2C13, 0x8642, 0x6890, 0xC2C1, 0xA515, 0x0F44, 0xE196, 0x4BC7,
+    0x33B8, 0x99E9, 0x773B, 0xDD6A, 0xBABE, 0x10EF, 0xFE3D, 0x546C,
+    0x3195, 0x9BC4, 0x7516, 0xDF47, 0xB893, 0x12C2, 0xFC10, 0x5641,
+    0x37E2, 0x9DB3, 0x7361, 0xD930, 0xBEE4, 0x14B5, 0xFA67, 0x5036,
+    0x35CF, 0x9F9E, 0x714C, 0xDB1D, 0xBCC9, 0x1698, 0xF84A, 0x521B,
+    0x3B0C, 0x915D, 0x7F8F, 0xD5DE, 0xB20A, 0x185B, 0xF689, 0x5CD8,
+    0x3921, 0x9370, 0x7DA2, 0xD7F3, 0xB027, 0x1A76, 0xF4A4, 0x5EF5,
+    0x3F56, 0x9507, 0x7BD5, 0xD184, 0xB650, 0x1C01, 0xF2D3, 0x5882,
+    0x3D7B, 0x972A, 0x79F8, 0xD3A9, 0xB47D, 0x1E2C, 0xF0FE, 0x5AAF
+  },
+  {
+    0x0000, 0x45A0, 0x8B40, 0xCEE0, 0x06A1, 0x4301, 0x8DE1, 0xC841,
+    0x0D42, 0x48E2, 0x8602, 0xC3A2, 0x0BE3, 0x4E43, 0x80A3, 0xC503,
+    0x1A84, 0x5F24, 0x91C4, 0xD464, 0x1C25, 0x5985, 0x9765, 0xD2C5,
+    0x17C6, 0x5266, 0x9C86, 0xD926, 0x1167, 0x54C7, 0x9A27, 0xDF87,
+    0x3508, 0x70A8, 0xBE48, 0xFBE8, 0x33A9, 0x7609, 0xB8E9, 0xFD49,
+    0x384A, 0x7DEA, 0xB30A, 0xF6AA, 0x3EEB, 0x7B4B, 0xB5AB, 0xF00B,
+    0x2F8C, 0x6A2C, 0xA4CC, 0xE16C, 0x292D, 0x6C8D, 0xA26D, 0xE7CD,
+    0x22CE, 0x676E, 0xA98E, 0xEC2E, 0x246F, 0x61CF, 0xAF2F, 0xEA8F,
+    0x6A10, 0x2FB0, 0xE150, 0xA4F0, 0x6CB1, 0x2911, 0xE7F1, 0xA251,
+    0x6752, 0x22F2, 0xEC12, 0xA9B2, 0x61F3, 0x2453, 0xEAB3, 0xAF13,
+    0x7094, 0x3534, 0xFBD4, 0xBE74, 0x7635, 0x3395, 0xFD75, 0xB8D5,
+    0x7DD6, 0x3876, 0xF696, 0xB336, 0x7B77, 0x3ED7, 0xF037, 0xB597,
+    0x5F18, 0x1AB8, 0xD458, 0x91F8, 0x59B9, 0x1C19, 0xD2F9, 0x9759,
+    0x525A, 0x17FA, 0xD91A, 0x9CBA, 0x54FB, 0x115B, 0xDFBB, 0x9A1B,
+    0x459C, 0x003C, 0xCEDC, 0x8B7C, 0x433D, 0x069D, 0xC87D, 0x8DDD,
+    0x48DE, 0x0D7E, 0xC39E, 0x863E, 0x4E7F, 0x0BDF, 0xC53F, 0x809F,
+    0xD420, 0x9180, 0x5F60, 0x1AC0, 0xD281, 0x9721, 0x59C1, 0x1C61,
+    0xD962, 0x9CC2, 0x5222, 0x1782, 0xDFC3, 0x9A63, 0x5483, 0x1123,
+    0xCEA4, 0x8B04, 0x45E4, 0x0044, 0xC805, 0x8DA5, 0x4345, 0x06E5,
+    0xC3E6, 0x8646, 0x48A6, 0x0D06, 0xC547, 0x80E7, 0x4E07, 0x0BA7,
+    0xE128, 0xA488, 0x6A68, 0x2FC8, 0xE789, 0xA229, 0x6CC9, 0x2969,
+    0xEC6A, 0xA9CA, 0x672A, 0x228A, 0xEACB, 0xAF6B, 0x618B, 0x242B,
+    0xFBAC, 0xBE0C, 0x70EC, 0x354C, 0xFD0D, 0xB8AD, 0x764D, 0x33ED,
+    0xF6EE, 0xB34E, 0x7DAE, 0x380E, 0xF04F, 0xB5EF, 0x7B0F, 0x3EAF,
+    0xBE30, 0xFB90, 0x3570, 0x70D0, 0xB891, 0xFD31, 0x33D1, 0x7671,
+    0xB372, 0xF6D2, 0x3832, 0x7D92, 0xB5D3, 0xF073, 0x3E93, 0x7B33,
+    0xA4B4, 0xE114, 0x2FF4, 0x6A54, 0xA215, 0xE7B5, 0x2955, 0x6CF5,
+    0xA9F6, 0xEC56, 0x22B6, 0x6716, 0xAF57, 0xEAF7, 0x2417, 0x61B7,
+    0x8B38, 0xCE98, 0x0078, 0x45D8, 0x8D99, 0xC839, 0x06D9, 0x4379,
+    0x867A, 0xC3DA, 0x0D3A, 0x489A, 0x80DB, 0xC57B, 0x0B9B, 0x4E3B,
+    0x91BC, 0xD41C, 0x1AFC, 0x5F5C, 0x971D, 0xD2BD, 0x1C5D, 0x59FD,
+    0x9CFE, 0xD95E, 0x17BE, 0x521E, 0x9A5F, 0xDFFF, 0x111F, 0x54BF
+  },
+  {
+    0x0000, 0xB861, 0x60E3, 0xD882, 0xC1C6, 0x79A7, 0xA125, 0x1944,
+    0x93AD, 0x2BCC, 0xF34E, 0x4B2F, 0x526B, 0xEA0A, 0x3288, 0x8AE9,
+    0x377B, 0x8F1A, 0x5798, 0xEFF9, 0xF6BD, 0x4EDC, 0x965E, 0x2E3F,
+    0xA4D6, 0x1CB7, 0xC435, 0x7C54, 0x6510, 0xDD71, 0x05F3, 0xBD92,
+    0x6EF6, 0xD697, 0x0E15, 0xB674, 0xAF30, 0x1751, 0xCFD3, 0x77B2,
+    0xFD5B, 0x453A, 0x9DB8, 0x25D9, 0x3C9D, 0x84FC, 0x5C7E, 0xE41F,
+    0x598D, 0xE1EC, 0x396E, 0x810F, 0x984B, 0x202A, 0xF8A8, 0x40C9,
+    0xCA20, 0x7241, 0xAAC3, 0x12A2, 0x0BE6, 0xB387, 0x6B05, 0xD364,
+    0xDDEC, 0x658D, 0xBD0F, 0x056E, 0x1C2A, 0xA44B, 0x7CC9, 0xC4A8,
+    0x4E41, 0xF620, 0x2EA2, 0x96C3, 0x8F87, 0x37E6, 0xEF64, 0x5705,
+    0xEA97, 0x52F6, 0x8A74, 0x3215, 0x2B51, 0x9330, 0x4BB2, 0xF3D3,
+    0x793A, 0xC15B, 0x19D9, 0xA1B8, 0xB8FC, 0x009D, 0xD81F, 0x607E,
+    0xB31A, 0x0B7B, 0xD3F9, 0x6B98, 0x72DC, 0xCABD, 0x123F, 0xAA5E,
+    0x20B7, 0x98D6, 0x4054, 0xF835, 0xE171, 0x5910, 0x8192, 0x39F3,
+    0x8461, 0x3C00, 0xE482, 0x5CE3, 0x45A7, 0xFDC6, 0x2544, 0x9D25,
+    0x17CC, 0xAFAD, 0x772F, 0xCF4E, 0xD60A, 0x6E6B, 0xB6E9, 0x0E88,
+    0xABF9, 0x1398, 0xCB1A, 0x737B, 0x6A3F, 0xD25E, 0x0ADC, 0xB2BD,
+    0x3854, 0x8035, 0x58B7, 0xE0D6, 0xF992, 0x41F3, 0x9971, 0x2110,
+    0x9C82, 0x24E3, 0xFC61, 0x4400, 0x5D44, 0xE525, 0x3DA7, 0x85C6,
+    0x0F2F, 0xB74E, 0x6FCC, 0xD7AD, 0xCEE9, 0x7688, 0xAE0A, 0x166B,
+    0xC50F, 0x7D6E, 0xA5EC, 0x1D8D, 0x04C9, 0xBCA8, 0x642A, 0xDC4B,
+    0x56A2, 0xEEC3, 0x3641, 0x8E20, 0x9764, 0x2F05, 0xF787, 0x4FE6,
+    0xF274, 0x4A15, 0x9297, 0x2AF6, 0x33B2, 0x8BD3, 0x5351, 0xEB30,
+    0x61D9, 0xD9B8, 0x013A, 0xB95B, 0xA01F, 0x187E, 0xC0FC, 0x789D,
+    0x7615, 0xCE74, 0x16F6, 0xAE97, 0xB7D3, 0x0FB2, 0xD730, 0x6F51,
+    0xE5B8, 0x5DD9, 0x855B, 0x3D3A, 0x247E, 0x9C1F, 0x449D, 0xFCFC,
+    0x416E, 0xF90F, 0x218D, 0x99EC, 0x80A8, 0x38C9, 0xE04B, 0x582A,
+    0xD2C3, 0x6AA2, 0xB220, 0x0A41, 0x1305, 0xAB64, 0x73E6, 0xCB87,
+    0x18E3, 0xA082, 0x7800, 0xC061, 0xD925, 0x6144, 0xB9C6, 0x01A7,
+    0x8B4E, 0x332F, 0xEBAD, 0x53CC, 0x4A88, 0xF2E9, 0x2A6B, 0x920A,
+    0x2F98, 0x97F9, 0x4F7B, 0xF71A, 0xEE5E, 0x563F, 0x8EBD, 0x36DC,
+    0xBC35, 0x0454, 0xDCD6, 0x64B7, 0x7DF3, 0xC592, 0x1D10, 0xA571
+  },
+  {
+    0x0000, 0x47D3, 0x8FA6, 0xC875, 0x0F6D, 0x48BE, 0x80CB, 0xC718,
+    0x1EDA, 0x5909, 0x917C, 0xD6AF, 0x11B7, 0x5664, 0x9E11, 0xD9C2,
+    0x3DB4, 0x7A67, 0xB212, 0xF5C1, 0x32D9, 0x750A, 0xBD7F, 0xFAAC,
+    0x236E, 0x64BD, 0xACC8, 0xEB1B, 0x2C03, 0x6BD0, 0xA3A5, 0xE476,
+    0x7B68, 0x3CBB, 0xF4CE, 0xB31D, 0x7405, 0x33D6, 0xFBA3, 0xBC70,
+    0x65B2, 0x2261, 0xEA14, 0xADC7, 0x6ADF, 0x2D0C, 0xE579, 0xA2AA,
+    0x46DC, 0x010F, 0xC97A, 0x8EA9, 0x49B1, 0x0E62, 0xC617, 0x81C4,
+    0x5806, 0x1FD5, 0xD7A0, 0x9073, 0x576B, 0x10B8, 0xD8CD, 0x9F1E,
+    0xF6D0, 0xB103, 0x7976, 0x3EA5, 0xF9BD, 0xBE6E, 0x761B, 0x31C8,
+    0xE80A, 0xAFD9, 0x67AC, 0x207F, 0xE767, 0xA0B4, 0x68C1, 0x2F12,
+    0xCB64, 0x8CB7, 0x44C2, 0x0311, 0xC409, 0x83DA, 0x4BAF, 0x0C7C,
+    0xD5BE, 0x926D, 0x5A18, 0x1DCB, 0xDAD3, 0x9D00, 0x5575, 0x12A6,
+    0x8DB8, 0xCA6B, 0x021E, 0x45CD, 0x82D5, 0xC506, 0x0D73, 0x4AA0,
+    0x9362, 0xD4B1, 0x1CC4, 0x5B17, 0x9C0F, 0xDBDC, 0x13A9, 0x547A,
+    0xB00C, 0xF7DF, 0x3FAA, 0x7879, 0xBF61, 0xF8B2, 0x30C7, 0x7714,
+    0xAED6, 0xE905, 0x2170, 0x66A3, 0xA1BB, 0xE668, 0x2E1D, 0x69CE,
+    0xFD81, 0xBA52, 0x7227, 0x35F4, 0xF2EC, 0xB53F, 0x7D4A, 0x3A99,
+    0xE35B, 0xA488, 0x6CFD, 0x2B2E, 0xEC36, 0xABE5, 0x6390, 0x2443,
+    0xC035, 0x87E6, 0x4F93, 0x0840, 0xCF58, 0x888B, 0x40FE, 0x072D,
+    0xDEEF, 0x993C, 0x5149, 0x169A, 0xD182, 0x9651, 0x5E24, 0x19F7,
+    0x86E9, 0xC13A, 0x094F, 0x4E9C, 0x8984, 0xCE57, 0x0622, 0x41F1,
+    0x9833, 0xDFE0, 0x1795, 0x5046, 0x975E, 0xD08D, 0x18F8, 0x5F2B,
+    0xBB5D, 0xFC8E, 0x34FB, 0x7328, 0xB430, 0xF3E3, 0x3B96, 0x7C45,
+    0xA587, 0xE254, 0x2A21, 0x6DF2, 0xAAEA, 0xED39, 0x254C, 0x629F,
+    0x0B51, 0x4C82, 0x84F7, 0xC324, 0x043C, 0x43EF, 0x8B9A, 0xCC49,
+    0x158B, 0x5258, 0x9A2D, 0xDDFE, 0x1AE6, 0x5D35, 0x9540, 0xD293,
+    0x36E5, 0x7136, 0xB943, 0xFE90, 0x3988, 0x7E5B, 0xB62E, 0xF1FD,
+    0x283F, 0x6FEC, 0xA799, 0xE04A, 0x2752, 0x6081, 0xA8F4, 0xEF27,
+    0x7039, 0x37EA, 0xFF9F, 0xB84C, 0x7F54, 0x3887, 0xF0F2, 0xB721,
+    0x6EE3, 0x2930, 0xE145, 0xA696, 0x618E, 0x265D, 0xEE28, 0xA9FB,
+    0x4D8D, 0x0A5E, 0xC22B, 0x85F8, 0x42E0, 0x0533, 0xCD46, 0x8A95,
+    0x5357, 0x1484, 0xDCF1, 0x9B22, 0x5C3A, 0x1BE9, 0xD39C, 0x944F
+  }
+};
+
+// CRC32 (IEEE 802.3, reflected polynomial 0xEDB88320) table for page hashes
+const uint32_t IAP_CRC32_Table[256] =
+{
+  0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F,
+  0xE963A535, 0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
+  0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2,
+  0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+  0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9,
+  0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
+  0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
+  0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+  0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423,
+  0xCFBA9599, 0xB8BDA50F, 0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
+  0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D, 0x76DC4190, 0x01DB7106,
+  0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+  0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D,
+  0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+  0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950,
+  0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+  0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7,
+  0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
+  0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C, 0x270241AA,
+  0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+  0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
+  0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
+  0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84,
+  0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+  0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB,
+  0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
+  0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E,
+  0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+  0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55,
+  0x316E8EEF, 0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
+  0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28,
+  0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+  0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F,
+  0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
+  0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
+  0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+  0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69,
+  0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
+  0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC,
+  0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+  0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693,
+  0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+  0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+};
+
+// SHA-256 round constants and initial hash value (FIPS 180-4)
+const uint32_t IAP_SHA256_K[64] =
+{
+  0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1,
+  0x923F82A4, 0xAB1C5ED5, 0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+  0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174, 0xE49B69C1, 0xEFBE4786,
+  0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+  0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147,
+  0x06CA6351, 0x14292967, 0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+  0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85, 0xA2BFE8A1, 0xA81A664B,
+  0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+  0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A,
+  0x5B9CCA4F, 0x682E6FF3, 0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+  0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+const uint32_t IAP_SHA256_H0[8] =
+{
+  0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C,
+  0x1F83D9AB, 0x5BE0CD19
+};
 CAN_HandleTypeDef *CAN_Handle;
 
 /**********************************************
@@ -30,12 +452,15 @@ void IAP_Status_Check( void )
   pFunction JumpToApplication;
   uint32_t JumpAddress;
   uint32_t New_Program_Location;
-  if( *(uint32_t*) IAP_IS_PROGRAMMED == IAP_TRUE )
+  IAP_Boot_Timing_Start();
+  New_Program_Location = IAP_Active_Slot();
+  if( New_Program_Location != 0 )
   {
-    // Confirm that program exists at IAP_APPLICATION_ADDRESS location
-    if (((*(__IO uint32_t*)IAP_APPLICATION_ADDRESS) & 0x2FFE0000 ) == 0x20000000)
+    // Confirm that program exists at the active slot and is the image that was sent
+    if( (((*(__IO uint32_t*)New_Program_Location) & 0x2FFE0000 ) == 0x20000000) &&
+        (IAP_Validate_Image(New_Program_Location) == HAL_OK) )
     {
-      New_Program_Location = *(uint32_t*) IAP_FLASHED_PROGRAM_LOCATION;  
+      IAP_Boot_Mark( IAP_BOOT_CHECKS );
       // Set jump memory location for system memory
       JumpAddress = *(uint32_t*) ( New_Program_Location + 4 );
       JumpToApplication = (pFunction) JumpAddress;
@@ -43,12 +468,246 @@ void IAP_Status_Check( void )
       __set_MSP( *(uint32_t*) New_Program_Location );
       // Disable Initialization
       HAL_DeInit();
+      IAP_Boot_Mark( IAP_BOOT_JUMP );
       // Call the function to jump to new program location
       JumpToApplication(); 
       // Should never hit this
       Error_Handler();
     }
   }  
+  IAP_Boot_Mark( IAP_BOOT_CHECKS );
+}
+
+/**********************************************
+  Name: IAP_Boot_Timing_Start
+  Description: starts the boot timing record of
+        this boot and marks the end of 
+        IAP_BOOT_MAIN.
+**********************************************/
+void IAP_Boot_Timing_Start( void )
+{
+  memset( &Boot_Timing, 0, sizeof(Boot_Timing) );
+  Boot_Timing.Magic = IAP_BOOT_TIMING_MAGIC;
+  IAP_Boot_Mark( IAP_BOOT_MAIN );
+}
+
+/**********************************************
+  Name: IAP_Boot_Mark
+  Description: records the DWT cycle count and 
+        core clock at the end of a boot phase.
+**********************************************/
+void IAP_Boot_Mark( uint8_t phase )
+{
+  Boot_Timing.Cycles[phase] = DWT->CYCCNT;
+  Boot_Timing.MHz[phase] = SystemCoreClock / 1000000;
+}
+
+/**********************************************
+  Name: IAP_Validate_Image
+  Description: checks the image in the slot at
+        location against the length and CRC32 of
+        its image header once, on the first boot
+        after an update, and writes the validity
+        token if it matches. Boots after that 
+        only look for the token.
+**********************************************/
+HAL_StatusTypeDef IAP_Validate_Image( uint32_t location )
+{
+  HAL_StatusTypeDef status;
+  uint32_t record = IAP_Marker_Active();
+  uint32_t length;
+  uint32_t crc;
+  
+  if( record == 0 )
+  {
+    // Markers written before the marker log have no header, keep booting the image
+    return HAL_OK;
+  }
+  length = *(uint32_t*) (record + IAP_MARKER_HEADER);
+  crc = *(uint32_t*) (record + IAP_MARKER_HEADER + 4);
+  if( (*(uint32_t*) (record + IAP_MARKER_TOKEN) == IAP_VALID_TOKEN) && 
+      (*(uint32_t*) (record + IAP_MARKER_TOKEN + 4) == crc) )
+  {
+    return HAL_OK;
+  }
+  if( (length == 0) || (length > IAP_SLOT_SIZE) || (IAP_CRC32(0, (uint8_t*) location, length) != crc) )
+  {
+    return HAL_ERROR;
+  }
+  // Runs before HAL_Init, IAP_Flash_Program only polls BSY so no tick is needed
+  HAL_FLASH_Unlock( );
+  status = IAP_Flash_Program( record + IAP_MARKER_TOKEN, ((uint64_t) crc << 32) | IAP_VALID_TOKEN );
+  HAL_FLASH_Lock( );
+  // A token that did not program only costs the check again on the next boot
+  (void) status;
+  return HAL_OK;
+}
+
+/**********************************************
+  Name: IAP_Marker_Active
+  Description: returns the address of the 
+        committed marker record with the highest
+        sequence number in either log page, or 0
+        if there is none.
+**********************************************/
+uint32_t IAP_Marker_Active( void )
+{
+  uint32_t pages[2] = { IAP_MARKER_LOG_A, IAP_MARKER_LOG_B };
+  uint32_t active = 0;
+  uint32_t record;
+  uint8_t i;
+  
+  for( i = 0; i < 2; i++ )
+  {
+    for( record = pages[i]; record + IAP_MARKER_RECORD_SIZE <= pages[i] + FLASH_PAGE_SIZE; record += IAP_MARKER_RECORD_SIZE )
+    {
+      if( (*(uint32_t*) (record + IAP_MARKER_COMMITTED) == IAP_MARKER_COMMIT) &&
+          (*(uint32_t*) (record + IAP_MARKER_COMMITTED + 4) == IAP_TRUE) &&
+          ((active == 0) || (*(uint32_t*) (record + IAP_MARKER_SLOT + 4) > *(uint32_t*) (active + IAP_MARKER_SLOT + 4))) )
+      {
+        active = record;
+      }
+    }
+  }
+  return active;
+}
+
+/**********************************************
+  Name: IAP_Marker_Next
+  Description: returns where the next record of
+        the log page at page goes, past the last
+        record that was started, or 0 if the 
+        page is full.
+**********************************************/
+uint32_t IAP_Marker_Next( uint32_t page )
+{
+  uint32_t next = page;
+  uint32_t record;
+  uint8_t i;
+  
+  for( record = page; record + IAP_MARKER_RECORD_SIZE <= page + FLASH_PAGE_SIZE; record += IAP_MARKER_RECORD_SIZE )
+  {
+    for( i = 0; i < IAP_MARKER_RECORD_SIZE; i += 4 )
+    {
+      if( *(uint32_t*) (record + i) != 0xFFFFFFFF )
+      {
+        // Records cut short by a reset are skipped, never written over
+        next = record + IAP_MARKER_RECORD_SIZE;
+        break;
+      }
+    }
+  }
+  return ( next + IAP_MARKER_RECORD_SIZE <= page + FLASH_PAGE_SIZE ) ? next : 0;
+}
+
+/**********************************************
+  Name: IAP_Marker_Append
+  Description: appends a record that boots the
+        slot at slot, holding the image length,
+        CRC32 and firmware version. The record 
+        only counts once its commit double word,
+        written last, is in. A full log page moves the log to the
+        other page, erasing that one first.
+**********************************************/
+HAL_StatusTypeDef IAP_Marker_Append( uint32_t slot, uint32_t length, uint32_t crc, uint32_t version )
+{
+  HAL_StatusTypeDef status;
+  uint32_t active = IAP_Marker_Active();
+  uint32_t page = IAP_MARKER_LOG_A;
+  uint32_t sequence = 1;
+  uint32_t record;
+  
+  if( active != 0 )
+  {
+    page = ( active < IAP_MARKER_LOG_B ) ? IAP_MARKER_LOG_A : IAP_MARKER_LOG_B;
+    sequence = *(uint32_t*) (active + IAP_MARKER_SLOT + 4) + 1;
+  }
+  record = IAP_Marker_Next( page );
+  if( record == 0 )
+  {
+    page = ( page == IAP_MARKER_LOG_A ) ? IAP_MARKER_LOG_B : IAP_MARKER_LOG_A;
+    if( IAP_Erase_Flash_Memory(page, 1) != HAL_OK )
+    {
+      return HAL_ERROR;
+    }
+    record = page;
+  }
+  HAL_FLASH_Unlock( );
+  status = IAP_Flash_Program( record + IAP_MARKER_SLOT, ((uint64_t) sequence << 32) | slot );
+  if( status == HAL_OK )
+  {
+    status = IAP_Flash_Program( record + IAP_MARKER_HEADER, ((uint64_t) crc << 32) | length );
+  }
+  if( (status == HAL_OK) && (version != IAP_VERSION_UNKNOWN) )
+  {
+    status = IAP_Flash_Program( record + IAP_MARKER_VERSION, ((uint64_t) 0xFFFFFFFF << 32) | version );
+  }
+  if( status == HAL_OK )
+  {
+    status = IAP_Flash_Program( record + IAP_MARKER_COMMITTED, ((uint64_t) IAP_TRUE << 32) | IAP_MARKER_COMMIT );
+  }
+  HAL_FLASH_Lock( );
+  return status;
+}
+
+/**********************************************
+  Name: IAP_Active_Slot
+  Description: returns the start address of the
+        slot the active marker record says to 
+        boot, or 0 if there is no programmed 
+        slot.
+**********************************************/
+uint32_t IAP_Active_Slot( void )
+{
+  uint32_t location;
+  uint32_t record = IAP_Marker_Active();
+  
+  if( record != 0 )
+  {
+    location = *(uint32_t*) (record + IAP_MARKER_SLOT);
+  }
+  else if( *(uint32_t*) IAP_IS_PROGRAMMED == IAP_TRUE )
+  {
+    location = *(uint32_t*) IAP_FLASHED_PROGRAM_LOCATION;
+  }
+  else
+  {
+    return 0;
+  }
+  if( (location != IAP_SLOT_A_ADDRESS) && (location != IAP_SLOT_B_ADDRESS) )
+  {
+    return 0;
+  }
+  return location;
+}
+
+/**********************************************
+  Name: IAP_Inactive_Slot
+  Description: returns the start address of the
+        slot a download is written to, the one
+        that is not active.
+**********************************************/
+uint32_t IAP_Inactive_Slot( void )
+{
+  return ( IAP_Active_Slot() == IAP_SLOT_A_ADDRESS ) ? IAP_SLOT_B_ADDRESS : IAP_SLOT_A_ADDRESS;
+}
+
+/**********************************************
+  Name: IAP_Slot_Number
+  Description: converts a slot start address to
+        IAP_SLOT_A, IAP_SLOT_B or IAP_SLOT_NONE.
+**********************************************/
+uint8_t IAP_Slot_Number( uint32_t address )
+{
+  if( address == IAP_SLOT_A_ADDRESS )
+  {
+    return IAP_SLOT_A;
+  }
+  if( address == IAP_SLOT_B_ADDRESS )
+  {
+    return IAP_SLOT_B;
+  }
+  return IAP_SLOT_NONE;
 }
 
 /**********************************************
@@ -64,6 +723,40 @@ HAL_StatusTypeDef IAP_init( CAN_HandleTypeDef *hcan )
   Is_Last_Frame = 0;
   Address_in_Page = 0;
   Program_CRC = 0;
+  Window_Size = 0;
+  Window_Discard = 0;
+  IAP_Block_Size( 0 );
+  Transfer_Mode = IAP_TRANSFER_RAW;
+  Broadcast = IAP_BROADCAST_OFF;
+  IAP_Clear_Received();
+  IAP_Journal_Scan();
+  uint32_t uid[3] = { HAL_GetUIDw0(), HAL_GetUIDw1(), HAL_GetUIDw2() };
+  Node_UID_Hash = IAP_CRC32(0, (uint8_t*) uid, sizeof(uid));
+  Node_ID = ( IAP_NODE_ID != 0 ) ? IAP_NODE_ID : (Node_UID_Hash % 127) + 1;
+  // Nothing may be programmed before IAP_Start
+  Slot_Address = IAP_Inactive_Slot();
+  Image_End = Slot_Address;
+  Erased_Up_To = Slot_Address;
+  Erase_Busy = 0;
+  Erase_Error = 0;
+  IAP_Rx_Head = 0;
+  IAP_Rx_Tail = 0;
+  IAP_Rx_Queue_Overruns = 0;
+  IAP_Rx_FIFO_Overruns = 0;
+  IAP_Rx_Control_Overruns = 0;
+  IAP_Rx_High_Water = 0;
+  Abort_Pending = 0;
+  Bootloader_Pending = 0;
+  IAP_Tx_Head = 0;
+  IAP_Tx_Tail = 0;
+  IAP_Tx_Queue_Overruns = 0;
+  memset( Telemetry, 0, sizeof(Telemetry) );
+  memcpy( IAP_Vector_Table, (void*) SCB->VTOR, sizeof(IAP_Vector_Table) );
+  __DSB();
+  SCB->VTOR = (uint32_t) IAP_Vector_Table;
+  __DSB();
+  HAL_NVIC_SetPriority(FLASH_IRQn, IAP_FLASH_IRQ_PRIORITY, 0);
+  HAL_NVIC_EnableIRQ(FLASH_IRQn);
   return HAL_OK;
 }
 
@@ -77,6 +770,8 @@ void IAP_Start_STM_Bootloader( void )
   void (*SysMemBootJump)(void);
   // Set the address of the entry point to bootloader
   uint32_t BootAddr = IAP_STM_BOOTLOADER_LOCATION;
+  // Let the answers still queued go out
+  IAP_CAN_Flush();
   // Disable Systick timer
   SysTick->CTRL = 0;
   SysTick->LOAD = 0;
@@ -110,9 +805,16 @@ void IAP_Start_STM_Bootloader( void )
 **********************************************/
 HAL_StatusTypeDef IAP_Route_Messages( CAN_RxHeaderTypeDef *pHeader, uint8_t RxMessage[] )
 {
-  uint32_t destination, firstHalfOfDataFromCAN, secondHalfOfDataFromCAN;
+  uint16_t NbrOfFrames;
   uint8_t payload[8];
   
+  if( (Broadcast == IAP_BROADCAST_STANDBY) && (pHeader->DLC != IAP_PROGRAM_START) &&
+      ((pHeader->DLC != IAP_EXTENDED_COMMAND) || (RxMessage[0] != IAP_CMD_NODE_QUERY)) )
+  {
+    // Another slot is being broadcast, wait for the next IAP_PROGRAM_START
+    return HAL_OK;
+  }
+  
   switch( pHeader->DLC )
   {
     case IAP_PROGRAM_START :
@@ -120,9 +822,46 @@ HAL_StatusTypeDef IAP_Route_Messages( CAN_RxHeaderTypeDef *pHeader, uint8_t RxMe
       {
         IAP_Start_STM_Bootloader();
       }
+      else if( RxMessage[0] == IAP_START_HEADER )
+      {
+        Broadcast = IAP_BROADCAST_OFF;
+        IAP_Start_From_Header( RxMessage[1] );
+      }
       else
       {
-        if( IAP_Start() != HAL_OK ) 
+        uint32_t imageLength = 0;
+        uint8_t mode = IAP_TRANSFER_RAW;
+        uint8_t blockPages = 0;
+        if( (RxMessage[0] == IAP_START_SIZED) || (RxMessage[0] == IAP_START_DELTA) || 
+            (RxMessage[0] == IAP_START_COMPRESSED) || (RxMessage[0] == IAP_START_BROADCAST) )
+        {
+          imageLength = (RxMessage[1] << 16) | (RxMessage[2] << 8) | RxMessage[3];
+        }
+        if( (RxMessage[0] == IAP_START_SIZED) || (RxMessage[0] == IAP_START_COMPRESSED) )
+        {
+          blockPages = RxMessage[4];
+        }
+        Broadcast = IAP_BROADCAST_OFF;
+        if( RxMessage[0] == IAP_START_BROADCAST )
+        {
+          // Every node gets the same image, it has to be linked for our download slot
+          if( IAP_Slot_Number(IAP_Inactive_Slot()) != RxMessage[4] )
+          {
+            Broadcast = IAP_BROADCAST_STANDBY;
+            break;
+          }
+          Broadcast = IAP_BROADCAST_ON;
+          mode = IAP_TRANSFER_DELTA;
+        }
+        if( RxMessage[0] == IAP_START_DELTA )
+        {
+          mode = IAP_TRANSFER_DELTA;
+        }
+        else if( RxMessage[0] == IAP_START_COMPRESSED )
+        {
+          mode = IAP_TRANSFER_COMPRESSED;
+        }
+        if( IAP_Start( imageLength, mode, blockPages ) != HAL_OK ) 
         {
           payload[0] = IAP_Status;
           payload[1] = payload[2] = payload[3] = payload[4] = payload[5] = payload[6] = payload[7] = 0;
@@ -138,17 +877,24 @@ HAL_StatusTypeDef IAP_Route_Messages( CAN_RxHeaderTypeDef *pHeader, uint8_t RxMe
       break;
 
     case IAP_WRITE_TO_FLASH :        
-      destination = IAP_APPLICATION_ADDRESS + ((iteration + Address_in_Page) << 3);
-      firstHalfOfDataFromCAN = (uint32_t) & RxMessage[0];
-      secondHalfOfDataFromCAN = (uint32_t) & RxMessage[4];
-      __disable_irq();
-      IAP_WriteFrameToFlash(destination, (uint32_t*) firstHalfOfDataFromCAN, (uint32_t*) secondHalfOfDataFromCAN) ;
-      __enable_irq();
-      if( (Address_in_Page > IAP_FRAMES_PER_PAGE - 1) || (Is_Last_Frame == 1) )
+      if( Window_Discard == 1 )
+      {
+        // Frames still in flight after a NACK, the host resends them
+        break;
+      }
+      if( pHeader->IDE == CAN_ID_EXT )
+      {
+        IAP_Stage_Sequenced_Frame( pHeader->ExtId, RxMessage );
+        break;
+      }
+      if( Address_in_Page < IAP_BLOCK_BUFFER_FRAMES )
+      {
+        memcpy( &Page_Buffer[Address_in_Page], RxMessage, 8 );
+      }
+      if( (Window_Size == 0) && (Transfer_Mode != IAP_TRANSFER_DELTA) && ((Address_in_Page > Block_Frames - 1) || (Is_Last_Frame == 1)) )
       {
         Program_CRC = 0;
-        destination = IAP_APPLICATION_ADDRESS + ((iteration) << 3);
-        IAP_Calculate_CRC_for_Memory_Frame(destination);
+        IAP_Calculate_CRC_for_Memory_Frame((uint32_t) Page_Buffer, Address_in_Page + 1);
         payload[0] = Program_CRC >> 8;
         payload[1] = Program_CRC & 0xFF;
         payload[2] = payload[3] = payload[4] = payload[5] = payload[6] = payload[7] = 0;
@@ -167,37 +913,193 @@ HAL_StatusTypeDef IAP_Route_Messages( CAN_RxHeaderTypeDef *pHeader, uint8_t RxMe
     case IAP_CRC_FAILED : 
       if(RxMessage[0] == IAP_CRC_FAILED & RxMessage[1] == IAP_CRC_FAILED)
       {
-        uint32_t start = IAP_APPLICATION_ADDRESS + ((iteration) << 3);
-        uint8_t NbrOfPages = 1;
-        if( IAP_Erase_Flash_Memory(start, NbrOfPages) != HAL_OK )
+        // The block never left the staging buffer, so nothing needs erasing
+        Telemetry[IAP_TELEMETRY_CRC_FAILURES] ++;
+        payload[0] = payload[1] = payload[2] = IAP_READY;
+        payload[3] = payload[4] = payload[5] = payload[6] = payload[7] = 0;
+        IAP_CAN_Send( CAN_IAP_UPDATE_FIRMWARE, CAN_ID_STD, payload, 3 );
+        Address_in_Page = 0;
+        Is_Last_Frame = 0;
+      }       
+      break;
+
+    case IAP_CRC_SUCCEEDED : 
+      if(RxMessage[0] == IAP_CRC_SUCCEEDED & RxMessage[1] == IAP_CRC_SUCCEEDED)
+      {
+        // The frame after a full block is resent as the first frame of the next block
+        NbrOfFrames = Address_in_Page;
+        if( (Is_Last_Frame == 0) && (NbrOfFrames > Block_Frames) )
         {
-          payload[0] = payload[1] = payload[2] = IAP_ERASE_FAILED;
+          NbrOfFrames = Block_Frames;
+        }
+        if( IAP_Store_Page(NbrOfFrames) != HAL_OK )
+        {
+          // Stay on this block, the host resends it from its first frame
+          payload[0] = payload[1] = payload[2] = IAP_WRITE_FAILED;
           payload[3] = payload[4] = payload[5] = payload[6] = payload[7] = 0;
           IAP_CAN_Send( CAN_IAP_UPDATE_FIRMWARE, CAN_ID_STD, payload, 3 );
         }
         else
         {
-          payload[0] = payload[1] = payload[2] = IAP_READY;
-          payload[3] = payload[4] = payload[5] = payload[6] = payload[7] = 0;
-          IAP_CAN_Send( CAN_IAP_UPDATE_FIRMWARE, CAN_ID_STD, payload, 3 );
-        } 
+          if( Transfer_Mode == IAP_TRANSFER_RAW )
+          {
+            IAP_Journal_Append( IAP_JOURNAL_PAGE, iteration + Block_Frames );
+          }
+          iteration += Block_Frames;
+        }
         Address_in_Page = 0;
-        Is_Last_Frame = 0;
       }       
       break;
 
-    case IAP_CRC_SUCCEEDED : 
-      if(RxMessage[0] == IAP_CRC_SUCCEEDED & RxMessage[1] == IAP_CRC_SUCCEEDED)
+    case IAP_EXTENDED_COMMAND :
+      if( RxMessage[0] == IAP_CMD_WINDOW_START )
       {
-        iteration += IAP_FRAMES_PER_PAGE;
-        Address_in_Page = 0;
-      }       
+        Window_Size = RxMessage[1];
+        if( Window_Size > IAP_WINDOW_MAX )
+        {
+          Window_Size = IAP_WINDOW_MAX;
+        }
+        Window_Discard = 0;
+        payload[0] = IAP_WINDOW_ACK;
+        payload[1] = (iteration / Block_Frames) >> 8;
+        payload[2] = (iteration / Block_Frames) & 0xFF;
+        payload[3] = Window_Size;
+        payload[4] = payload[5] = payload[6] = payload[7] = 0;
+        IAP_CAN_Send(CAN_IAP_CRC, CAN_ID_STD, payload, 4);
+      }
+      else if( (RxMessage[0] == IAP_CMD_PAGE_CHECK) && (Window_Size != 0) )
+      {
+        IAP_Window_Page_Check( (RxMessage[1] << 8) | RxMessage[2], (RxMessage[3] << 8) | RxMessage[4] );
+      }
+      else if( RxMessage[0] == IAP_CMD_IMAGE_CHECK )
+      {
+        uint32_t imageLength = ((RxMessage[1] << 16) | (RxMessage[2] << 8) | RxMessage[3]) << 3;
+        uint16_t imageCRC;
+        if( imageLength > IAP_SLOT_SIZE )
+        {
+          imageLength = IAP_SLOT_SIZE;
+        }
+        imageCRC = IAP_CRC16_Block(0, (uint8_t*) Slot_Address, imageLength);
+        payload[0] = IAP_IMAGE_CRC;
+        payload[1] = imageCRC >> 8;
+        payload[2] = imageCRC & 0xFF;
+        payload[3] = ( imageCRC == ((RxMessage[4] << 8) | RxMessage[5]) ) ? IAP_CRC_SUCCEEDED : IAP_CRC_FAILED;
+        payload[4] = payload[5] = payload[6] = payload[7] = 0;
+        IAP_CAN_Send(CAN_IAP_CRC, CAN_ID_STD, payload, 4);
+      }
+      else if( RxMessage[0] == IAP_CMD_CRC_BENCH )
+      {
+        IAP_CRC_Benchmark( (RxMessage[1] << 24) | (RxMessage[2] << 16) | (RxMessage[3] << 8) | RxMessage[4], RxMessage[5] );
+      }
+      else if( RxMessage[0] == IAP_CMD_QUEUE_STATUS )
+      {
+        payload[0] = IAP_QUEUE_STATUS;
+        payload[1] = IAP_Rx_Queue_Overruns >> 8;
+        payload[2] = IAP_Rx_Queue_Overruns & 0xFF;
+        payload[3] = IAP_Rx_FIFO_Overruns >> 8;
+        payload[4] = IAP_Rx_FIFO_Overruns & 0xFF;
+        payload[5] = IAP_Rx_High_Water;
+        payload[6] = ( IAP_Rx_Control_Overruns > 0xFF ) ? 0xFF : IAP_Rx_Control_Overruns;
+        payload[7] = ( IAP_Tx_Queue_Overruns > 0xFF ) ? 0xFF : IAP_Tx_Queue_Overruns;
+        IAP_CAN_Send(CAN_IAP_CRC, CAN_ID_STD, payload, 8);
+      }
+      else if( RxMessage[0] == IAP_CMD_SLOT_STATUS )
+      {
+        payload[0] = IAP_SLOT_STATUS;
+        payload[1] = IAP_Slot_Number( IAP_Active_Slot() );
+        payload[2] = IAP_Slot_Number( Slot_Address );
+        payload[3] = (IAP_SLOT_SIZE / FLASH_PAGE_SIZE) >> 8;
+        payload[4] = (IAP_SLOT_SIZE / FLASH_PAGE_SIZE) & 0xFF;
+        payload[5] = payload[6] = payload[7] = 0;
+        IAP_CAN_Send(CAN_IAP_CRC, CAN_ID_STD, payload, 5);
+      }
+      else if( RxMessage[0] == IAP_CMD_PAGE_MANIFEST )
+      {
+        IAP_Send_Page_Manifest( (RxMessage[1] << 8) | RxMessage[2], RxMessage[3] );
+      }
+      else if( (RxMessage[0] == IAP_CMD_PAGE_WRITE) && (Transfer_Mode == IAP_TRANSFER_DELTA) )
+      {
+        IAP_Write_Flash_Page( (RxMessage[1] << 8) | RxMessage[2], (RxMessage[3] << 8) | RxMessage[4] );
+      }
+      else if( RxMessage[0] == IAP_CMD_NODE_QUERY )
+      {
+        IAP_Send_Node_Info();
+      }
+      else if( RxMessage[0] == IAP_CMD_MISSING_FRAMES )
+      {
+        IAP_Send_Missing_Frames( (RxMessage[1] << 8) | RxMessage[2] );
+      }
+      else if( RxMessage[0] == IAP_CMD_RESUME_QUERY )
+      {
+        payload[0] = IAP_RESUME_STATUS;
+        payload[1] = Resume_Frames >> 16;
+        payload[2] = (Resume_Frames >> 8) & 0xFF;
+        payload[3] = Resume_Frames & 0xFF;
+        payload[4] = Resume_Length >> 16;
+        payload[5] = (Resume_Length >> 8) & 0xFF;
+        payload[6] = Resume_Length & 0xFF;
+        payload[7] = 0;
+        IAP_CAN_Send(CAN_IAP_CRC, CAN_ID_STD, payload, 7);
+      }
+      else if( RxMessage[0] == IAP_CMD_RESUME )
+      {
+        IAP_Resume( (RxMessage[1] << 16) | (RxMessage[2] << 8) | RxMessage[3], RxMessage[4] );
+      }
+      else if( (RxMessage[0] == IAP_CMD_BOOT_TIMING) && (RxMessage[1] < IAP_BOOT_PHASES) )
+      {
+        uint32_t cycles = ( Boot_Timing.Magic == IAP_BOOT_TIMING_MAGIC ) ? Boot_Timing.Cycles[RxMessage[1]] : 0;
+        payload[0] = IAP_BOOT_TIMING;
+        payload[1] = RxMessage[1];
+        payload[2] = cycles >> 24;
+        payload[3] = (cycles >> 16) & 0xFF;
+        payload[4] = (cycles >> 8) & 0xFF;
+        payload[5] = cycles & 0xFF;
+        payload[6] = Boot_Timing.MHz[RxMessage[1]];
+        payload[7] = 0;
+        IAP_CAN_Send(CAN_IAP_CRC, CAN_ID_STD, payload, 7);
+      }
+      else if( RxMessage[0] == IAP_CMD_TELEMETRY )
+      {
+        IAP_Send_Telemetry( RxMessage[1] );
+      }
+      else if( (RxMessage[0] == IAP_CMD_IMAGE_HEADER) && (RxMessage[1] < IAP_HEADER_WORDS) )
+      {
+        ((uint32_t*) &Image_Header)[RxMessage[1]] = (RxMessage[2] << 24) | (RxMessage[3] << 16) | (RxMessage[4] << 8) | RxMessage[5];
+        Image_Header_Words |= 1 << RxMessage[1];
+      }
+      else if( (RxMessage[0] == IAP_CMD_IMAGE_SHA256) && (RxMessage[1] < IAP_SHA256_WORDS) )
+      {
+        memcpy( &Image_SHA256[RxMessage[1] << 2], &RxMessage[2], 4 );
+        Image_SHA256_Words |= 1 << RxMessage[1];
+      }
+      else if( RxMessage[0] == IAP_CMD_IMAGE_CRC32 )
+      {
+        Image_CRC32 = (RxMessage[1] << 24) | (RxMessage[2] << 16) | (RxMessage[3] << 8) | RxMessage[4];
+        Image_CRC32_Set = 1;
+      }
+      else if( (RxMessage[0] == IAP_CMD_REWIND) && (Window_Size != 0) )
+      {
+        if( ((RxMessage[1] << 16) | (RxMessage[2] << 8) | RxMessage[3]) == iteration + Address_in_Page )
+        {
+          Window_Discard = 0;
+        }
+        else
+        {
+          // Host is out of step, tell it again where to resume
+          IAP_Window_Rewind();
+        }
+      }
       break;
 
     case IAP_LOAD_NEW_PROGRAM :
       if(RxMessage[0] == IAP_PROGRAMM_END)
       {
-        IAP_Complete_Programming( );
+        if( IAP_Complete_Programming( ) != HAL_OK )
+        {
+          payload[0] = payload[1] = payload[2] = IAP_Status;
+          payload[3] = payload[4] = payload[5] = payload[6] = payload[7] = 0;
+          IAP_CAN_Send( CAN_IAP_UPDATE_FIRMWARE, CAN_ID_STD, payload, 3 );
+        }
       }
       else if(RxMessage[0] == IAP_RESET_MARKERS)
       {
@@ -209,202 +1111,1839 @@ HAL_StatusTypeDef IAP_Route_Messages( CAN_RxHeaderTypeDef *pHeader, uint8_t RxMe
       break;
   }     
 
+  if( (IAP_Status != IAP_ALL_GOOD) && (IAP_Status != IAP_WRITE_BUSY) && (IAP_Status != IAP_WRITE_SUCCEEDED) )
+  {
+    Telemetry[IAP_TELEMETRY_LAST_ERROR] = IAP_Status;
+  }
   IAP_Status = IAP_ALL_GOOD;
   return HAL_OK;
 }
 
 /**********************************************
-  Name: IAP_Start
-  Description: starts the IAP process by erasing
-        user memory from IAP_APPLICATION_ADDRESS
-        to end of user memory, pausing all other
-        tasks to ensure data integrity, then 
-        waiting for data to be sent.
+  Name: IAP_Queue_Frame
+  Description: called from the CAN RX interrupt.
+        Copies the frame into the receive ring 
+        for IAP_Process_Queue and returns right
+        away. Counts an overrun and drops the 
+        frame if the ring is full, data frames 
+        leave the last IAP_QUEUE_CONTROL_RESERVE
+        slots to commands. Runs from RAM
+        so frames are queued while flash is busy.
 **********************************************/
-HAL_StatusTypeDef IAP_Start( void )
+__ramfunc HAL_StatusTypeDef IAP_Queue_Frame( CAN_RxHeaderTypeDef *pHeader, uint8_t RxMessage[] )
 {
-  uint8_t payload[8];
+  uint16_t head = IAP_Rx_Head;
+  uint16_t used = (uint16_t) (head - IAP_Rx_Tail);
+  IAP_Frame *p_frame = &IAP_Rx_Queue[head & (IAP_QUEUE_BUFF_SIZE - 1)];
+  uint8_t i;
   
-  // Erase User Memory
-  uint32_t start = IAP_APPLICATION_ADDRESS;
-  uint8_t NbrOfPages = ((FLASH_START_ADDRESS + FLASH_SIZE) - start) / FLASH_PAGE_SIZE;
-  if( IAP_Erase_Flash_Memory(start, NbrOfPages) != HAL_OK )
+  Telemetry[IAP_TELEMETRY_FRAMES_RECEIVED] ++;
+  if( (used >= IAP_QUEUE_BUFF_SIZE) || 
+      ((pHeader->DLC == IAP_WRITE_TO_FLASH) && (used >= IAP_QUEUE_BUFF_SIZE - IAP_QUEUE_CONTROL_RESERVE)) )
   {
-    payload[0] = payload[1] = payload[2] = IAP_ERASE_FAILED;
-    payload[3] = payload[4] = payload[5] = payload[6] = payload[7] = 0;
-    IAP_CAN_Send( CAN_IAP_UPDATE_FIRMWARE, CAN_ID_STD, payload, 3 );
+    IAP_Rx_Queue_Overruns ++;
+    return HAL_ERROR;
   }
-  else
+  // Field by field, a struct copy or memcpy could call library code in flash
+  p_frame->Header.StdId = pHeader->StdId;
+  p_frame->Header.ExtId = pHeader->ExtId;
+  p_frame->Header.IDE = pHeader->IDE;
+  p_frame->Header.RTR = pHeader->RTR;
+  p_frame->Header.DLC = pHeader->DLC;
+  p_frame->Header.Timestamp = pHeader->Timestamp;
+  p_frame->Header.FilterMatchIndex = pHeader->FilterMatchIndex;
+  for( i = 0; i < 8; i++ )
   {
-    payload[0] = payload[1] = payload[2] = IAP_READY;
-    payload[3] = payload[4] = payload[5] = payload[6] = payload[7] = 0;
-    IAP_CAN_Send( CAN_IAP_UPDATE_FIRMWARE, CAN_ID_STD, payload, 3 );
-  } 
-  
-  // Reset Variables
-  Address_in_Page = 0;
-  iteration = 0;
-  Program_CRC = 0;
-  Is_Last_Frame = 0;
-  
-  return HAL_OK;  
+    p_frame->Data[i] = RxMessage[i];
+  }
+  if( used + 1 > IAP_Rx_High_Water )
+  {
+    IAP_Rx_High_Water = used + 1;
+  }
+  // Frame must be complete before the consumer can see it
+  __DMB();
+  IAP_Rx_Head = head + 1;
+  return HAL_OK;
 }
 
 /**********************************************
-  Name: IAP_Complete_Programming
-  Description: After CAN messages have completed
-        (the IAP_PROGRAMM_END payload was sent
-        over the CAN) this method is called to 
-        update the program pointer to the new
-        program location and finalizes the 
-        programming.
+  Name: IAP_Process_Queue
+  Description: called from the main loop. Passes
+        every queued frame to IAP_Route_Messages
+        so flash programming, erases and CRCs 
+        run outside of interrupt context, and 
+        carries out a pending IAP_CMD_ABORT or 
+        bootloader jump from CAN_IAP_CONTROL.
 **********************************************/
-HAL_StatusTypeDef IAP_Complete_Programming( void )
+void IAP_Process_Queue( void )
 {
- 
-  uint64_t Temp = IAP_TRUE;
-  uint64_t Data;
-  HAL_StatusTypeDef status = HAL_ERROR;  
-  IAP_Status = IAP_WRITE_BUSY;
-  Data = Temp << 32;
-  uint8_t flashWriteLoopCounter = 0;
-  while( status != HAL_OK )
+  uint16_t tail = IAP_Rx_Tail;
+  IAP_Frame *p_frame;
+  
+  while( (tail != IAP_Rx_Head) || Abort_Pending || Bootloader_Pending )
   {
-    if( flashWriteLoopCounter > 10 )
+    if( Bootloader_Pending )
     {
-      IAP_Status = IAP_WRITE_FAILED;
-      return HAL_ERROR;
+      IAP_Start_STM_Bootloader();
     }
-    uint32_t start = IAP_FLASH_VAR_START_LOCATION;
-    uint32_t NbrOfPages = 1;
-    IAP_Erase_Flash_Memory( start, NbrOfPages );
-     __disable_irq( );
-     HAL_FLASH_Unlock( );  
-    status = HAL_FLASH_Program( FLASH_TYPEPROGRAM_DOUBLEWORD, IAP_FLASH_VAR_START_LOCATION, Data );
-    Data = (uint64_t) IAP_APPLICATION_ADDRESS;
-    status = HAL_FLASH_Program( FLASH_TYPEPROGRAM_DOUBLEWORD, IAP_FLASHED_PROGRAM_LOCATION, Data );
-    HAL_FLASH_Lock( );
-    flashWriteLoopCounter ++;
-    IAP_Status = IAP_WRITE_SUCCEEDED;
+    if( Abort_Pending )
+    {
+      tail = IAP_Abort_Transfer();
+      continue;
+    }
+    __DMB();
+    p_frame = &IAP_Rx_Queue[tail & (IAP_QUEUE_BUFF_SIZE - 1)];
+    if( IAP_Route_Messages(&p_frame->Header, p_frame->Data) != HAL_OK )
+    {
+      /* IAP Error */
+      Error_Handler();
+    }
+    tail ++;
+    IAP_Rx_Tail = tail;
   }
-  __enable_irq( );
-         
-  NVIC_SystemReset( );
-  return status;
+  IAP_Erase_Next_Page_IT();
 }
 
 /**********************************************
-  Name: IAP_Calculate_CRC_for_Memory_Frame
-  Description: computes the CRC of a CAN frame
-            after it has been written to memory
-            (computes it from read memory).
+  Name: IAP_Count_FIFO_Overrun
+  Description: called when the CAN hardware RX 
+        FIFO overran and a frame was lost 
+        before the interrupt could queue it.
 **********************************************/
-void IAP_Calculate_CRC_for_Memory_Frame( uint32_t Address )
+__ramfunc void IAP_Count_FIFO_Overrun( uint32_t RxFifo )
 {
-  uint16_t i;
-  for( i = 0; i < Address_in_Page + 1; i++)
+  if( RxFifo == CAN_RX_FIFO1 )
   {
-    uint32_t *p = (uint32_t*) (Address + (i * 8));
-    Program_CRC = IAP_Calculate_CRC16(Program_CRC, (uint8_t) p[0] & 0xFF);
-    Program_CRC = IAP_Calculate_CRC16(Program_CRC, (uint8_t) (p[0] >> 8) & 0xFF);
-    Program_CRC = IAP_Calculate_CRC16(Program_CRC, (uint8_t) (p[0] >> 16) & 0xFF);
-    Program_CRC = IAP_Calculate_CRC16(Program_CRC, (uint8_t) (p[0] >> 24) & 0xFF);
-    Program_CRC = IAP_Calculate_CRC16(Program_CRC, (uint8_t) p[1] & 0xFF);
-    Program_CRC = IAP_Calculate_CRC16(Program_CRC, (uint8_t) (p[1] >> 8) & 0xFF);
-    Program_CRC = IAP_Calculate_CRC16(Program_CRC, (uint8_t) (p[1] >> 16) & 0xFF);
-    Program_CRC = IAP_Calculate_CRC16(Program_CRC, (uint8_t) (p[1] >> 24) & 0xFF);
+    IAP_Rx_Control_Overruns ++;
   }
+  else
+  {
+    IAP_Rx_FIFO_Overruns ++;
+  }
+}
+
+/**********************************************
+  Name: IAP_Control_Frame
+  Description: called from the control FIFO 
+        interrupt for CAN_IAP_CONTROL frames. 
+        IAP_SEND_STATUS, IAP_CMD_QUEUE_STATUS 
+        and IAP_CMD_ABORT are answered right 
+        here, so they are not held up by a page
+        being committed or by the data queued 
+        ahead of them. IAP_STM_BOOTLOADER is 
+        taken by the main loop before any 
+        queued frame. Other commands are 
+        ignored on this ID, they have to stay 
+        in order with the data. Returns 0 if 
+        the frame is not a CAN_IAP_CONTROL 
+        frame and has to be queued. Runs from 
+        RAM.
+**********************************************/
+__ramfunc uint8_t IAP_Control_Frame( CAN_RxHeaderTypeDef *pHeader, uint8_t RxMessage[] )
+{
+  uint8_t payload[8];
+  
+  if( (pHeader->IDE != CAN_ID_STD) || (pHeader->StdId != CAN_IAP_CONTROL) )
+  {
+    return 0;
+  }
+  Telemetry[IAP_TELEMETRY_FRAMES_RECEIVED] ++;
+  if( (pHeader->DLC == IAP_PROGRAM_START) && (RxMessage[0] == IAP_STM_BOOTLOADER) )
+  {
+    // Not from the interrupt, the jump has to be made in thread mode
+    Bootloader_Pending = 1;
+  }
+  else if( Broadcast == IAP_BROADCAST_STANDBY )
+  {
+    // Another slot is being broadcast, nothing to answer
+  }
+  else if( pHeader->DLC == IAP_SEND_STATUS )
+  {
+    payload[0] = IAP_Status;
+    payload[1] = payload[2] = payload[3] = payload[4] = payload[5] = payload[6] = payload[7] = 0;
+    IAP_CAN_Send(CAN_IAP_UPDATE_FIRMWARE, CAN_ID_STD, payload, 1);
+  }
+  else if( (pHeader->DLC == IAP_EXTENDED_COMMAND) && (RxMessage[0] == IAP_CMD_QUEUE_STATUS) )
+  {
+    payload[0] = IAP_QUEUE_STATUS;
+    payload[1] = IAP_Rx_Queue_Overruns >> 8;
+    payload[2] = IAP_Rx_Queue_Overruns & 0xFF;
+    payload[3] = IAP_Rx_FIFO_Overruns >> 8;
+    payload[4] = IAP_Rx_FIFO_Overruns & 0xFF;
+    payload[5] = IAP_Rx_High_Water;
+    payload[6] = ( IAP_Rx_Control_Overruns > 0xFF ) ? 0xFF : IAP_Rx_Control_Overruns;
+    payload[7] = ( IAP_Tx_Queue_Overruns > 0xFF ) ? 0xFF : IAP_Tx_Queue_Overruns;
+    IAP_CAN_Send(CAN_IAP_CRC, CAN_ID_STD, payload, 8);
+  }
+  else if( (pHeader->DLC == IAP_EXTENDED_COMMAND) && (RxMessage[0] == IAP_CMD_ABORT) )
+  {
+    // Everything queued so far belongs to the aborted download
+    Abort_Head = IAP_Rx_Head;
+    __DMB();
+    Abort_Pending = 1;
+    payload[0] = payload[1] = payload[2] = IAP_ABORTED;
+    payload[3] = payload[4] = payload[5] = payload[6] = payload[7] = 0;
+    IAP_CAN_Send(CAN_IAP_UPDATE_FIRMWARE, CAN_ID_STD, payload, 3);
+  }
+  return 1;
+}
+
+/**********************************************
+  Name: IAP_Abort_Transfer
+  Description: called from IAP_Process_Queue 
+        after an IAP_CMD_ABORT. Drops the 
+        frames queued before the abort and the 
+        download in progress, data still in 
+        flight is discarded until the next 
+        IAP_PROGRAM_START. Returns the new ring
+        tail.
+**********************************************/
+uint16_t IAP_Abort_Transfer( void )
+{
+  uint16_t tail;
+  
+  Abort_Pending = 0;
+  __DMB();
+  tail = Abort_Head;
+  IAP_Rx_Tail = tail;
+  // Nothing in the download slot was switched to, so it is simply left behind
+  IAP_Wait_For_Erase();
+  Image_End = Slot_Address;
+  Erased_Up_To = Slot_Address;
+  Address_in_Page = 0;
+  Is_Last_Frame = 0;
+  iteration = 0;
+  Window_Size = 0;
+  Window_Discard = 1;
+  Broadcast = IAP_BROADCAST_OFF;
+  IAP_Clear_Received();
+  if( Transfer_Mode == IAP_TRANSFER_RAW )
+  {
+    // An aborted download is not resumed
+    IAP_Journal_Append( IAP_JOURNAL_DONE, 0 );
+  }
+  return tail;
+}
+
+/**********************************************
+  Name: IAP_Start
+  Description: starts the IAP process for an 
+        image of imageLength bytes (0 if the 
+        host did not send it) in the inactive
+        slot, the running image and the slot it
+        runs from are never touched. Nothing is erased
+        here, IAP_Commit_Page erases each flash
+        page just before its first write (or in
+        the background one page ahead), so the
+        host is told IAP_READY straight away, 
+        with the transfer block size it got.
+        mode is one of the IAP_TRANSFER modes.
+**********************************************/
+HAL_StatusTypeDef IAP_Start( uint32_t imageLength, uint8_t mode, uint8_t blockPages )
+{
+  uint8_t payload[8];
+  
+  if( imageLength > IAP_SLOT_SIZE )
+  {
+    payload[0] = payload[1] = payload[2] = IAP_IMAGE_TOO_LARGE;
+    payload[3] = payload[4] = payload[5] = payload[6] = payload[7] = 0;
+    IAP_CAN_Send( CAN_IAP_UPDATE_FIRMWARE, CAN_ID_STD, payload, 3 );
+    return HAL_OK;
+  }
+  IAP_Wait_For_Erase();
+  Slot_Address = IAP_Inactive_Slot();
+  Image_End = Slot_Address + (( imageLength == 0 ) ? IAP_SLOT_SIZE : imageLength);
+  Erased_Up_To = Slot_Address;
+  Transfer_Mode = mode;
+  Image_CRC32_Set = 0;
+  Image_Version = IAP_VERSION_UNKNOWN;
+  Image_SHA256_Words = 0;
+  IAP_SHA256_Init( &Image_Hash );
+  Hash_Up_To = Slot_Address;
+  IAP_Clear_Received();
+  // Start a fresh journal, only raw downloads can be resumed
+  Resume_Frames = 0;
+  Resume_Length = 0;
+  if( (Journal_Next != IAP_JOURNAL_START) && (IAP_Erase_Flash_Memory(IAP_JOURNAL_START, 1) == HAL_OK) )
+  {
+    Journal_Next = IAP_JOURNAL_START;
+  }
+  if( Transfer_Mode == IAP_TRANSFER_RAW )
+  {
+    IAP_Journal_Append( IAP_JOURNAL_TRANSFER, (IAP_Slot_Number(Slot_Address) << 24) | (Image_End - Slot_Address) );
+  }
+  Output_Page = Slot_Address;
+  Output_Fill = 0;
+  LZ_Flag_Count = 0;
+  LZ_Have_Token = 0;
+  if( Transfer_Mode == IAP_TRANSFER_DELTA )
+  {
+    // Pages are erased one at a time as they are written, the rest are kept
+    Erased_Up_To = Image_End;
+  }
+  payload[0] = payload[1] = payload[2] = IAP_READY;
+  payload[3] = IAP_Block_Size( blockPages );
+  payload[4] = payload[5] = payload[6] = payload[7] = 0;
+  IAP_CAN_Send( CAN_IAP_UPDATE_FIRMWARE, CAN_ID_STD, payload, 4 );
+  
+  // Reset Variables
+  Address_in_Page = 0;
+  iteration = 0;
+  Program_CRC = 0;
+  Is_Last_Frame = 0;
+  Window_Size = 0;
+  Window_Discard = 0;
+  
+  return HAL_OK;  
+}
+
+/**********************************************
+  Name: IAP_Block_Size
+  Description: sets the transfer block to 
+        blockPages flash pages, at most 
+        IAP_BLOCK_PAGES_MAX, or to the old 
+        IAP_FRAMES_PER_PAGE frames for 0. 
+        Returns the block size in pages that 
+        was taken.
+**********************************************/
+uint8_t IAP_Block_Size( uint8_t blockPages )
+{
+  if( blockPages > IAP_BLOCK_PAGES_MAX )
+  {
+    blockPages = IAP_BLOCK_PAGES_MAX;
+  }
+  Block_Frames = ( blockPages == 0 ) ? IAP_FRAMES_PER_PAGE : blockPages * IAP_PAGE_BUFFER_FRAMES;
+  return blockPages;
+}
+
+/**********************************************
+  Name: IAP_Start_From_Header
+  Description: starts a download described by 
+        the image header the host sent. Answers
+        IAP_SAME_VERSION instead if the active 
+        slot already holds that version and 
+        CRC32, IAP_WRONG_SLOT if the image is 
+        not linked for the download slot and 
+        IAP_BAD_HEADER if the header is not 
+        complete or not understood. Transfer
+        blocks are blockPages flash pages.
+**********************************************/
+HAL_StatusTypeDef IAP_Start_From_Header( uint8_t blockPages )
+{
+  uint8_t payload[8];
+  uint8_t answer = IAP_ALL_GOOD;
+  uint8_t mode = IAP_TRANSFER_RAW;
+  uint32_t active = IAP_Marker_Active();
+  
+  if( (Image_Header_Words != (1 << IAP_HEADER_WORDS) - 1) || (Image_Header.Magic != IAP_HEADER_MAGIC) ||
+      (Image_Header.Header_Version != IAP_HEADER_VERSION) )
+  {
+    answer = IAP_BAD_HEADER;
+  }
+  else if( Image_Header.Load_Address != IAP_Inactive_Slot() )
+  {
+    answer = IAP_WRONG_SLOT;
+  }
+  else if( (active != 0) && (IAP_Active_Slot() != 0) &&
+           (*(uint32_t*) (active + IAP_MARKER_VERSION) == Image_Header.Firmware_Version) &&
+           (*(uint32_t*) (active + IAP_MARKER_HEADER + 4) == Image_Header.Image_CRC32) )
+  {
+    answer = IAP_SAME_VERSION;
+  }
+  if( answer != IAP_ALL_GOOD )
+  {
+    payload[0] = payload[1] = payload[2] = answer;
+    payload[3] = payload[4] = payload[5] = payload[6] = payload[7] = 0;
+    IAP_CAN_Send( CAN_IAP_UPDATE_FIRMWARE, CAN_ID_STD, payload, 3 );
+    return HAL_OK;
+  }
+  if( Image_Header.Flags & IAP_HEADER_COMPRESSED )
+  {
+    mode = IAP_TRANSFER_COMPRESSED;
+  }
+  else if( Image_Header.Flags & IAP_HEADER_DELTA )
+  {
+    mode = IAP_TRANSFER_DELTA;
+  }
+  // The image length bounds the erases, nothing past it is touched
+  IAP_Start( Image_Header.Image_Length, mode, blockPages );
+  Image_CRC32 = Image_Header.Image_CRC32;
+  Image_CRC32_Set = 1;
+  Image_Version = Image_Header.Firmware_Version;
+  return HAL_OK;
+}
+
+/**********************************************
+  Name: IAP_Complete_Programming
+  Description: After CAN messages have completed
+        (the IAP_PROGRAMM_END payload was sent
+        over the CAN) this method is called to 
+        append a marker record for the slot that
+        was just written and reset into it. The
+        old slot is left intact. The record's 
+        image header holds the CRC32 the host sent with 
+        IAP_CMD_IMAGE_CRC32 or in the image 
+        header, which the slot has to match, or
+        the one of the slot as written for hosts
+        that send neither. The slot also has to
+        match the SHA-256 digest the host sent.
+        A slot whose reset vector points outside
+        of it is refused with IAP_WRONG_SLOT.
+**********************************************/
+HAL_StatusTypeDef IAP_Complete_Programming( void )
+{
+ 
+  HAL_StatusTypeDef status = HAL_ERROR;  
+  IAP_SHA256_Context hash;
+  uint8_t digest[IAP_SHA256_DIGEST_SIZE];
+  IAP_Status = IAP_WRITE_BUSY;
+  uint8_t flashWriteLoopCounter = 0;
+  uint32_t resetVector = (*(__IO uint32_t*)(Slot_Address + 4)) & ~1UL;
+  // Never switch over to a slot that does not hold a vector table
+  if( ((*(__IO uint32_t*)Slot_Address) & 0x2FFE0000 ) != 0x20000000 )
+  {
+    IAP_Status = IAP_WRITE_FAILED;
+    return HAL_ERROR;
+  }
+  // An image linked for the other slot would start in the old image
+  if( (resetVector < Slot_Address) || (resetVector >= Slot_Address + IAP_SLOT_SIZE) )
+  {
+    IAP_Status = IAP_WRONG_SLOT;
+    return HAL_ERROR;
+  }
+  IAP_Wait_For_Erase();
+  if( Image_CRC32_Set == 0 )
+  {
+    Image_CRC32 = IAP_CRC32(0, (uint8_t*) Slot_Address, Image_End - Slot_Address);
+  }
+  else if( IAP_CRC32(0, (uint8_t*) Slot_Address, Image_End - Slot_Address) != Image_CRC32 )
+  {
+    // The whole image is checked once more before anything is switched
+    Telemetry[IAP_TELEMETRY_CRC_FAILURES] ++;
+    IAP_Status = IAP_CRC_FAILED;
+    return HAL_ERROR;
+  }
+  // Only what was not hashed as it was committed is left, the running hash
+  // is finished on a copy so IAP_PROGRAMM_END can be sent again
+  IAP_Hash_Committed( Hash_Up_To, Image_End );
+  hash = Image_Hash;
+  IAP_SHA256_Final( &hash, digest );
+  if( (Image_SHA256_Words == (1 << IAP_SHA256_WORDS) - 1) ? 
+      (memcmp(digest, Image_SHA256, IAP_SHA256_DIGEST_SIZE) != 0) : IAP_REQUIRE_SHA256 )
+  {
+    IAP_Status = IAP_AUTH_FAILED;
+    return HAL_ERROR;
+  }
+  while( status != HAL_OK )
+  {
+    if( flashWriteLoopCounter > 10 )
+    {
+      IAP_Status = IAP_WRITE_FAILED;
+      return HAL_ERROR;
+    }
+    // A failed record never commits, the next try goes in the record after it
+    status = IAP_Marker_Append( Slot_Address, Image_End - Slot_Address, Image_CRC32, Image_Version );
+    if( flashWriteLoopCounter != 0 )
+    {
+      Telemetry[IAP_TELEMETRY_PROGRAM_RETRIES] ++;
+    }
+    flashWriteLoopCounter ++;
+    IAP_Status = IAP_WRITE_SUCCEEDED;
+  }
+  IAP_Journal_Append( IAP_JOURNAL_DONE, 0 );
+  IAP_CAN_Flush();
+         
+  NVIC_SystemReset( );
+  return status;
+}
+
+/**********************************************
+  Name: IAP_Calculate_CRC_for_Memory_Frame
+  Description: computes the CRC of NbrOfFrames
+            CAN frames after they have been 
+            written to memory (computes it from
+            read memory).
+**********************************************/
+void IAP_Calculate_CRC_for_Memory_Frame( uint32_t Address, uint16_t NbrOfFrames )
+{
+  uint32_t cycles = DWT->CYCCNT;
+  Program_CRC = IAP_CRC16_Block(Program_CRC, (uint8_t*) Address, NbrOfFrames << 3);
+  Telemetry[IAP_TELEMETRY_CRC_CYCLES] += DWT->CYCCNT - cycles;
+}
+
+/**********************************************
+  Name: IAP_CRC16_Block
+  Description: continues a CRC16_CCITT_ZERO 
+        (XModem) over length bytes at p_data.
+        Runs on the CRC peripheral when it has
+        been initialized, otherwise falls back 
+        to IAP_CRC16_Software.
+**********************************************/
+uint16_t IAP_CRC16_Block( uint16_t crc, uint8_t *p_data, uint32_t length )
+{
+#ifdef HAL_CRC_MODULE_ENABLED
+  if( (length != 0) && (hcrc.Instance == CRC) && (HAL_CRC_GetState(&hcrc) == HAL_CRC_STATE_READY) )
+  {
+    // Continue from crc, HAL_CRC_Calculate resets the data register to INIT
+    WRITE_REG(hcrc.Instance->INIT, crc);
+    return (uint16_t) HAL_CRC_Calculate(&hcrc, (uint32_t*) p_data, length);
+  }
+#endif /* HAL_CRC_MODULE_ENABLED */
+  return IAP_CRC16_Software(crc, p_data, length);
+}
+
+/**********************************************
+  Name: IAP_Window_Page_Check
+  Description: sliding window mode. Compares the
+        CRC of the page currently being written
+        with the CRC the host expects and sends
+        a cumulative ACK, or rewinds and NACKs
+        the page.
+**********************************************/
+void IAP_Window_Page_Check( uint16_t page, uint16_t expectedCRC )
+{
+  uint8_t payload[8];
+  uint16_t currentPage = iteration / Block_Frames;
+  
+  if( Window_Discard == 1 )
+  {
+    // Checks for pages sent before the host saw the NACK
+    return;
+  }
+  if( page < currentPage )
+  {
+    // Duplicate check, the page was already acknowledged
+    payload[0] = IAP_WINDOW_ACK;
+    payload[1] = currentPage >> 8;
+    payload[2] = currentPage & 0xFF;
+    payload[3] = payload[4] = payload[5] = payload[6] = payload[7] = 0;
+    IAP_CAN_Send(CAN_IAP_CRC, CAN_ID_STD, payload, 3);
+    return;
+  }
+  
+  Program_CRC = 0;
+  if( Address_in_Page <= Block_Frames )
+  {
+    IAP_Calculate_CRC_for_Memory_Frame((uint32_t) Page_Buffer, Address_in_Page);
+  }
+  if( (page == currentPage) && (Address_in_Page != 0) && (Address_in_Page <= Block_Frames) &&
+      (Program_CRC == expectedCRC) )
+  {
+    if( IAP_Store_Page(Address_in_Page) != HAL_OK )
+    {
+      payload[0] = payload[1] = payload[2] = IAP_WRITE_FAILED;
+      payload[3] = payload[4] = payload[5] = payload[6] = payload[7] = 0;
+      IAP_CAN_Send( CAN_IAP_UPDATE_FIRMWARE, CAN_ID_STD, payload, 3 );
+      IAP_Window_Rewind();
+      return;
+    }
+    iteration += Block_Frames;
+    Address_in_Page = 0;
+    if( Transfer_Mode == IAP_TRANSFER_RAW )
+    {
+      IAP_Journal_Append( IAP_JOURNAL_PAGE, iteration );
+    }
+    payload[0] = IAP_WINDOW_ACK;
+    payload[1] = (currentPage + 1) >> 8;
+    payload[2] = (currentPage + 1) & 0xFF;
+    payload[3] = payload[4] = payload[5] = payload[6] = payload[7] = 0;
+    IAP_CAN_Send(CAN_IAP_CRC, CAN_ID_STD, payload, 3);
+  }
+  else
+  {
+    Telemetry[IAP_TELEMETRY_CRC_FAILURES] ++;
+    IAP_Window_Rewind();
+  }
+}
+
+/**********************************************
+  Name: IAP_Window_Rewind
+  Description: sliding window mode. Drops the
+        staged page and tells the host to resume
+        from the start of it. Data frames are 
+        discarded until the host answers with 
+        IAP_CMD_REWIND.
+**********************************************/
+void IAP_Window_Rewind( void )
+{
+  uint8_t payload[8];
+  uint16_t failedPage = iteration / Block_Frames;
+  
+  Window_Discard = 1;
+  Address_in_Page = 0;
+  payload[0] = IAP_WINDOW_NACK;
+  payload[1] = (iteration >> 16) & 0xFF;
+  payload[2] = (iteration >> 8) & 0xFF;
+  payload[3] = iteration & 0xFF;
+  payload[4] = failedPage >> 8;
+  payload[5] = failedPage & 0xFF;
+  payload[6] = payload[7] = 0;
+  IAP_CAN_Send(CAN_IAP_CRC, CAN_ID_STD, payload, 6);
+}
+
+/**********************************************
+  Name: IAP_Calculate_CRC16
+  Description: While program is transfering
+        this function is called to update the 
+        CRC to assure that the program that was 
+        transfered is valid. 
+
+        Uses CRC16_CCITT_ZERO (XModem)
+**********************************************/
+uint16_t IAP_Calculate_CRC16( uint16_t crc, uint8_t data )
+{
+  return (uint16_t) (crc << 8) ^ IAP_CRC16_Table[0][(uint8_t) ((crc >> 8) ^ data)];
+}
+
+/**********************************************
+  Name: IAP_CRC16_Software
+  Description: software CRC16_CCITT_ZERO over
+        length bytes, eight bytes per step 
+        (slicing-by-8) with the remainder done 
+        a byte at a time.
+**********************************************/
+uint16_t IAP_CRC16_Software( uint16_t crc, const uint8_t *p_data, uint32_t length )
+{
+  while( length >= 8 )
+  {
+    crc = IAP_CRC16_Table[7][p_data[0] ^ (crc >> 8)]   ^ IAP_CRC16_Table[6][p_data[1] ^ (crc & 0xFF)] ^
+          IAP_CRC16_Table[5][p_data[2]] ^ IAP_CRC16_Table[4][p_data[3]] ^
+          IAP_CRC16_Table[3][p_data[4]] ^ IAP_CRC16_Table[2][p_data[5]] ^
+          IAP_CRC16_Table[1][p_data[6]] ^ IAP_CRC16_Table[0][p_data[7]];
+    p_data += 8;
+    length -= 8;
+  }
+  while( length-- != 0 )
+  {
+    crc = IAP_Calculate_CRC16(crc, *p_data++);
+  }
+  return crc;
+}
+
+/**********************************************
+  Name: IAP_CRC32
+  Description: continues a CRC32 (IEEE 802.3, 
+        the zlib crc32) over length bytes at 
+        p_data, a byte at a time.
+**********************************************/
+uint32_t IAP_CRC32( uint32_t crc, const uint8_t *p_data, uint32_t length )
+{
+  crc = ~crc;
+  while( length-- != 0 )
+  {
+    crc = (crc >> 8) ^ IAP_CRC32_Table[(uint8_t) (crc ^ *p_data++)];
+  }
+  return ~crc;
+}
+
+/**********************************************
+  Name: IAP_SHA256_Init
+  Description: starts a SHA-256 over nothing.
+**********************************************/
+void IAP_SHA256_Init( IAP_SHA256_Context *p_context )
+{
+  memcpy( p_context->State, IAP_SHA256_H0, sizeof(p_context->State) );
+  p_context->Length = 0;
+  p_context->Fill = 0;
+}
+
+/**********************************************
+  Name: IAP_SHA256_Update
+  Description: continues a SHA-256 over length
+        bytes at p_data. Whole blocks are 
+        hashed in place, only the bytes of a
+        partial block are copied.
+**********************************************/
+void IAP_SHA256_Update( IAP_SHA256_Context *p_context, const uint8_t *p_data, uint32_t length )
+{
+  uint8_t *p_block = (uint8_t*) p_context->Block;
+  
+  p_context->Length += length;
+  while( length != 0 )
+  {
+    if( (p_context->Fill == 0) && (length >= IAP_SHA256_BLOCK_SIZE) )
+    {
+      IAP_SHA256_Transform( p_context->State, p_data );
+      p_data += IAP_SHA256_BLOCK_SIZE;
+      length -= IAP_SHA256_BLOCK_SIZE;
+    }
+    else
+    {
+      p_block[p_context->Fill++] = *p_data++;
+      length --;
+      if( p_context->Fill == IAP_SHA256_BLOCK_SIZE )
+      {
+        IAP_SHA256_Transform( p_context->State, p_block );
+        p_context->Fill = 0;
+      }
+    }
+  }
+}
+
+/**********************************************
+  Name: IAP_SHA256_Final
+  Description: pads the SHA-256 and writes the
+        digest, big-endian, to p_digest. The 
+        context has to be started again after.
+**********************************************/
+void IAP_SHA256_Final( IAP_SHA256_Context *p_context, uint8_t *p_digest )
+{
+  uint8_t *p_block = (uint8_t*) p_context->Block;
+  uint64_t bits = (uint64_t) p_context->Length << 3;
+  uint8_t i;
+  
+  p_block[p_context->Fill++] = 0x80;
+  if( p_context->Fill > IAP_SHA256_BLOCK_SIZE - 8 )
+  {
+    memset( &p_block[p_context->Fill], 0, IAP_SHA256_BLOCK_SIZE - p_context->Fill );
+    IAP_SHA256_Transform( p_context->State, p_block );
+    p_context->Fill = 0;
+  }
+  memset( &p_block[p_context->Fill], 0, IAP_SHA256_BLOCK_SIZE - 8 - p_context->Fill );
+  for( i = 0; i < 8; i++ )
+  {
+    p_block[IAP_SHA256_BLOCK_SIZE - 1 - i] = (uint8_t) (bits >> (i << 3));
+  }
+  IAP_SHA256_Transform( p_context->State, p_block );
+  for( i = 0; i < IAP_SHA256_DIGEST_SIZE; i++ )
+  {
+    p_digest[i] = (uint8_t) (p_context->State[i >> 2] >> (24 - ((i & 0x03) << 3)));
+  }
+}
+
+/**********************************************
+  Name: IAP_SHA256_Transform
+  Description: hashes the 64 byte block at 
+        p_block into state.
+**********************************************/
+void IAP_SHA256_Transform( uint32_t *state, const uint8_t *p_block )
+{
+  uint32_t w[16];
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  uint32_t t1, t2;
+  uint8_t i;
+  
+  for( i = 0; i < 64; i++ )
+  {
+    if( i < 16 )
+    {
+      // The M4 loads unaligned words, partial blocks and flash alike
+      w[i] = __REV( ((const uint32_t*) p_block)[i] );
+    }
+    else
+    {
+      w[i & 15] += IAP_SHA256_SIG1(w[(i + 14) & 15]) + w[(i + 9) & 15] + IAP_SHA256_SIG0(w[(i + 1) & 15]);
+    }
+    t1 = h + IAP_SHA256_EP1(e) + IAP_SHA256_CH(e, f, g) + IAP_SHA256_K[i] + w[i & 15];
+    t2 = IAP_SHA256_EP0(a) + IAP_SHA256_MAJ(a, b, c);
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+/**********************************************
+  Name: IAP_Hash_Committed
+  Description: feeds the image SHA-256 with the
+        flash of the download slot from where it
+        stopped up to end, if the page just 
+        committed at destination continues it.
+        A page committed again behind it starts
+        the hash over.
+**********************************************/
+void IAP_Hash_Committed( uint32_t destination, uint32_t end )
+{
+  uint32_t cycles = DWT->CYCCNT;
+  
+  if( destination < Hash_Up_To )
+  {
+    IAP_SHA256_Init( &Image_Hash );
+    Hash_Up_To = Slot_Address;
+  }
+  if( end > Image_End )
+  {
+    end = Image_End;
+  }
+  // Pages committed out of order are left for IAP_Complete_Programming
+  if( (destination <= Hash_Up_To) && (end > Hash_Up_To) )
+  {
+    IAP_SHA256_Update( &Image_Hash, (uint8_t*) Hash_Up_To, end - Hash_Up_To );
+    Hash_Up_To = end;
+  }
+  Telemetry[IAP_TELEMETRY_HASH_CYCLES] += DWT->CYCCNT - cycles;
+}
+
+/**********************************************
+  Name: IAP_Send_Page_Manifest
+  Description: delta updates. Sends the CRC32 of
+        NbrOfPages flash pages of the download
+        slot from first, one IAP_PAGE_HASH frame
+        per page, so the host can leave out the 
+        pages that already match the new image.
+**********************************************/
+void IAP_Send_Page_Manifest( uint16_t first, uint16_t NbrOfPages )
+{
+  uint8_t payload[8];
+  uint32_t hash;
+  uint16_t page;
+  
+  if( (NbrOfPages == 0) || (first + NbrOfPages > IAP_SLOT_PAGES) )
+  {
+    NbrOfPages = ( first < IAP_SLOT_PAGES ) ? IAP_SLOT_PAGES - first : 0;
+  }
+  for( page = first; page < first + NbrOfPages; page++ )
+  {
+    hash = IAP_CRC32(0, (uint8_t*) (Slot_Address + (page * FLASH_PAGE_SIZE)), FLASH_PAGE_SIZE);
+    payload[0] = IAP_PAGE_HASH;
+    payload[1] = page >> 8;
+    payload[2] = page & 0xFF;
+    payload[3] = hash >> 24;
+    payload[4] = (hash >> 16) & 0xFF;
+    payload[5] = (hash >> 8) & 0xFF;
+    payload[6] = hash & 0xFF;
+    payload[7] = 0;
+    IAP_CAN_Send(CAN_IAP_CRC, CAN_ID_STD, payload, 7);
+  }
+}
+
+/**********************************************
+  Name: IAP_Write_Flash_Page
+  Description: delta updates. Checks the CRC of
+        the frames staged for flash page 
+        page of the download slot, then erases,
+        programs and verifies just that page and
+        answers with IAP_PAGE_WRITTEN. Only the
+        page being staged is written, and only 
+        once every frame of it has arrived. A 
+        page that already holds the staged 
+        frames is not written again (broadcast
+        resends).
+**********************************************/
+void IAP_Write_Flash_Page( uint16_t page, uint16_t expectedCRC )
+{
+  uint8_t payload[8];
+  uint32_t destination = Slot_Address + (page * FLASH_PAGE_SIZE);
+  
+  payload[0] = IAP_PAGE_WRITTEN;
+  payload[1] = page >> 8;
+  payload[2] = page & 0xFF;
+  payload[3] = IAP_CRC_FAILED;
+  payload[4] = payload[5] = payload[6] = payload[7] = 0;
+  
+  Program_CRC = 0;
+  // A matching CRC16 alone could still leave frames of another page in the buffer
+  if( (Address_in_Page != 0) && (Address_in_Page <= IAP_PAGE_BUFFER_FRAMES) && (page < IAP_SLOT_PAGES) &&
+      (page == Seq_Page) && (IAP_Frames_Received(Address_in_Page) == 1) )
+  {
+    IAP_Calculate_CRC_for_Memory_Frame((uint32_t) Page_Buffer, Address_in_Page);
+    if( (Program_CRC == expectedCRC) && (memcmp((void*) destination, Page_Buffer, Address_in_Page << 3) == 0) )
+    {
+      payload[3] = IAP_CRC_SUCCEEDED;
+    }
+    else if( Program_CRC != expectedCRC )
+    {
+      Telemetry[IAP_TELEMETRY_CRC_FAILURES] ++;
+    }
+    else
+    {
+      payload[3] = IAP_WRITE_FAILED;
+      if( (IAP_Erase_Flash_Memory(destination, 1) == HAL_OK) &&
+          (IAP_Commit_Page(destination, Page_Buffer, Address_in_Page) == HAL_OK) )
+      {
+        payload[3] = IAP_CRC_SUCCEEDED;
+      }
+    }
+  }
+  Address_in_Page = 0;
+  IAP_Clear_Received();
+  IAP_CAN_Send(CAN_IAP_CRC, CAN_ID_STD, payload, 4);
+}
+
+/**********************************************
+  Name: IAP_CRC_Benchmark
+  Description: fills the staging buffer with 
+        NbrOfFrames frames of xorshift32 data 
+        from seed and reports the CRC and DWT
+        cycle count of every CRC16 engine and of
+        the SHA-256, one CAN_IAP_CRC frame each. 0
+        frames is a whole flash page. Only to be
+        used while no page is being staged.
+**********************************************/
+void IAP_CRC_Benchmark( uint32_t seed, uint16_t NbrOfFrames )
+{
+  uint8_t payload[8];
+  uint8_t *p_data = (uint8_t*) Page_Buffer;
+  uint32_t length, cycles, i;
+  uint16_t crc;
+  uint8_t engine;
+  IAP_SHA256_Context hash;
+  uint8_t digest[IAP_SHA256_DIGEST_SIZE];
+  
+  if( (NbrOfFrames == 0) || (NbrOfFrames > IAP_PAGE_BUFFER_FRAMES) )
+  {
+    NbrOfFrames = IAP_PAGE_BUFFER_FRAMES;
+  }
+  length = NbrOfFrames << 3;
+  if( seed == 0 )
+  {
+    seed = 1;
+  }
+  for( i = 0; i < length; i += 4 )
+  {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    memcpy( &p_data[i], &seed, 4 );
+  }
+  
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  for( engine = IAP_CRC_ENGINE_TABLE; engine <= IAP_CRC_ENGINE_SHA256; engine++ )
+  {
+    crc = 0;
+    cycles = DWT->CYCCNT;
+    if( engine == IAP_CRC_ENGINE_TABLE )
+    {
+      for( i = 0; i < length; i++ )
+      {
+        crc = IAP_Calculate_CRC16(crc, p_data[i]);
+      }
+    }
+    else if( engine == IAP_CRC_ENGINE_SLICE_BY_8 )
+    {
+      crc = IAP_CRC16_Software(crc, p_data, length);
+    }
+    else if( engine == IAP_CRC_ENGINE_HARDWARE )
+    {
+      crc = IAP_CRC16_Block(crc, p_data, length);
+    }
+    else
+    {
+      IAP_SHA256_Init( &hash );
+      IAP_SHA256_Update( &hash, p_data, length );
+      IAP_SHA256_Final( &hash, digest );
+      crc = (digest[0] << 8) | digest[1];
+    }
+    cycles = DWT->CYCCNT - cycles;
+    payload[0] = IAP_CRC_BENCH;
+    payload[1] = engine;
+    payload[2] = crc >> 8;
+    payload[3] = crc & 0xFF;
+    payload[4] = cycles >> 24;
+    payload[5] = (cycles >> 16) & 0xFF;
+    payload[6] = (cycles >> 8) & 0xFF;
+    payload[7] = cycles & 0xFF;
+    IAP_CAN_Send(CAN_IAP_CRC, CAN_ID_STD, payload, 8);
+  }
+}
+
+/**********************************************
+  Name: IAP_WriteFrameToFlash
+  Description: Receives CAN message and writes
+        CAN payload to flash memory in temporary
+        location.
+**********************************************/
+HAL_StatusTypeDef IAP_WriteFrameToFlash( uint32_t destination, uint32_t *p_source, uint32_t *p_source2 )
+{
+  uint64_t Data = *p_source;
+  uint64_t Data2 = *p_source2;
+  HAL_StatusTypeDef status = HAL_ERROR;  
+  IAP_Status = IAP_WRITE_BUSY;
+  Data = ( Data2 << 32 ) | Data;
+  uint8_t flashWriteLoopCounter = 0;
+  uint32_t cycles = DWT->CYCCNT;
+  while ( status != HAL_OK )
+  {
+    if( flashWriteLoopCounter > 10 )
+    {
+      IAP_Status = IAP_WRITE_FAILED;
+      Telemetry[IAP_TELEMETRY_PROGRAM_CYCLES] += DWT->CYCCNT - cycles;
+      return HAL_ERROR;
+    }
+    if( flashWriteLoopCounter != 0 )
+    {
+      Telemetry[IAP_TELEMETRY_PROGRAM_RETRIES] ++;
+    }
+    HAL_FLASH_Unlock();    
+    status = IAP_Flash_Program( destination, Data ); 
+    HAL_FLASH_Lock();
+    flashWriteLoopCounter ++;
+    IAP_Status = IAP_WRITE_SUCCEEDED;
+  }
+  Telemetry[IAP_TELEMETRY_PROGRAM_CYCLES] += DWT->CYCCNT - cycles;
+  return status;
+}
+
+/**********************************************
+  Name: IAP_Commit_Page
+  Description: programs NbrOfFrames staged frames
+        to flash at destination with a single
+        unlock. Whole 32 double-word rows are 
+        written with fast programming, the rest
+        one double-word at a time. The result is
+        read back and compared to the source. 
+        Stops at the first failed write, the 
+        caller erases and commits again.
+**********************************************/
+HAL_StatusTypeDef IAP_Commit_Page( uint32_t destination, uint64_t *p_source, uint16_t NbrOfFrames )
+{
+  HAL_StatusTypeDef status = HAL_OK;
+  uint16_t i = 0;
+  uint32_t cycles;
+  
+  if( IAP_Erase_Ahead(destination + (NbrOfFrames << 3)) != HAL_OK )
+  {
+    return HAL_ERROR;
+  }
+  cycles = DWT->CYCCNT;
+  IAP_Status = IAP_WRITE_BUSY;
+  HAL_FLASH_Unlock();
+  // A failed write leaves the flash partly programmed, writing it again can only fail
+  while( (i < NbrOfFrames) && (status == HAL_OK) )
+  {
+    if( ((destination + (i << 3)) % IAP_FLASH_ROW_SIZE == 0) && (i + IAP_FLASH_ROW_FRAMES <= NbrOfFrames) )
+    {
+      status = IAP_Flash_Program_Row( destination + (i << 3), &p_source[i] );
+      i += IAP_FLASH_ROW_FRAMES;
+    }
+    else
+    {
+      status = IAP_Flash_Program( destination + (i << 3), p_source[i] );
+      i ++;
+    }
+  }
+  HAL_FLASH_Lock();
+  Telemetry[IAP_TELEMETRY_PROGRAM_CYCLES] += DWT->CYCCNT - cycles;
+  
+  if( (status != HAL_OK) || (memcmp((void*) destination, p_source, NbrOfFrames << 3) != 0) )
+  {
+    IAP_Status = IAP_WRITE_FAILED;
+    return HAL_ERROR;
+  }
+  IAP_Hash_Committed( destination, destination + (NbrOfFrames << 3) );
+  IAP_Status = IAP_WRITE_SUCCEEDED;
+  return HAL_OK;
+}
+
+/**********************************************
+  Name: IAP_Store_Page
+  Description: writes the transfer block at 
+        iteration once its CRC was accepted. Raw
+        images are committed as they are, 
+        compressed ones go through 
+        IAP_Decompress. A raw block that fails
+        to commit is erased, just its own flash
+        pages, and written once more. A 
+        compressed block that fails leaves the 
+        decoder where the block started, so the
+        host can resend it.
+**********************************************/
+HAL_StatusTypeDef IAP_Store_Page( uint16_t NbrOfFrames )
+{
+  uint32_t destination = Slot_Address + (iteration << 3);
+  
+  if( Transfer_Mode == IAP_TRANSFER_COMPRESSED )
+  {
+    IAP_Decompress_Save();
+    if( IAP_Decompress((uint8_t*) Page_Buffer, NbrOfFrames << 3) == HAL_OK )
+    {
+      return HAL_OK;
+    }
+    IAP_Decompress_Restore();
+    return HAL_ERROR;
+  }
+  if( IAP_Commit_Page(destination, Page_Buffer, NbrOfFrames) == HAL_OK )
+  {
+    return HAL_OK;
+  }
+  // Old IAP_FRAMES_PER_PAGE blocks share flash pages with their neighbours
+  if( (Block_Frames % IAP_PAGE_BUFFER_FRAMES != 0) || (IAP_Status == IAP_IMAGE_TOO_LARGE) ||
+      (IAP_Erase_Flash_Memory(destination, (NbrOfFrames + IAP_PAGE_BUFFER_FRAMES - 1) / IAP_PAGE_BUFFER_FRAMES) != HAL_OK) )
+  {
+    return HAL_ERROR;
+  }
+  Telemetry[IAP_TELEMETRY_PROGRAM_RETRIES] ++;
+  return IAP_Commit_Page( destination, Page_Buffer, NbrOfFrames );
+}
+
+/**********************************************
+  Name: IAP_Decompress
+  Description: compressed transfers. Decodes 
+        length bytes of the LZSS stream into the
+        output buffer, committing each flash 
+        page as it fills and the last one when
+        the image length is reached. Decoder 
+        state is kept between calls so tokens 
+        may be split across transfer pages.
+**********************************************/
+HAL_StatusTypeDef IAP_Decompress( const uint8_t *p_data, uint32_t length )
+{
+  uint8_t *p_output = (uint8_t*) Output_Buffer;
+  int32_t position;
+  uint16_t offset, count;
+  
+  // Padding after the last token is ignored once the image is complete
+  while( (length != 0) && (Output_Page + Output_Fill < Image_End) )
+  {
+    if( LZ_Flag_Count == 0 )
+    {
+      LZ_Flags = *p_data++;
+      LZ_Flag_Count = 8;
+      length --;
+      continue;
+    }
+    if( LZ_Flags & 0x01 )
+    {
+      if( IAP_Decompress_Output(*p_data++) != HAL_OK )
+      {
+        return HAL_ERROR;
+      }
+      length --;
+    }
+    else
+    {
+      if( LZ_Have_Token == 0 )
+      {
+        LZ_Token = *p_data++;
+        LZ_Have_Token = 1;
+        length --;
+        if( length == 0 )
+        {
+          // Second byte of the match is in the next transfer page
+          break;
+        }
+      }
+      offset = ((LZ_Token << 4) | (*p_data >> 4)) + 1;
+      count = (*p_data & 0x0F) + IAP_LZ_MIN_MATCH;
+      p_data ++;
+      length --;
+      LZ_Have_Token = 0;
+      while( count-- != 0 )
+      {
+        position = (int32_t) Output_Fill - offset;
+        if( Output_Page + position < Slot_Address )
+        {
+          IAP_Status = IAP_WRITE_FAILED;
+          return HAL_ERROR;
+        }
+        // Bytes before the output buffer are already in flash
+        if( IAP_Decompress_Output( (position >= 0) ? p_output[position] : 
+                                   *(uint8_t*) (Output_Page + position) ) != HAL_OK )
+        {
+          return HAL_ERROR;
+        }
+      }
+    }
+    LZ_Flags >>= 1;
+    LZ_Flag_Count --;
+  }
+  return HAL_OK;
+}
+
+/**********************************************
+  Name: IAP_Decompress_Output
+  Description: appends one decoded byte to the
+        output buffer and commits the buffer
+        when it holds a whole flash page or the
+        end of the image. A whole page that 
+        failed to commit stays in the buffer and
+        is committed before anything is added.
+**********************************************/
+HAL_StatusTypeDef IAP_Decompress_Output( uint8_t value )
+{
+  uint8_t *p_output = (uint8_t*) Output_Buffer;
+  
+  if( (Output_Fill >= FLASH_PAGE_SIZE) && (IAP_Decompress_Commit() != HAL_OK) )
+  {
+    return HAL_ERROR;
+  }
+  if( Output_Page + Output_Fill >= Image_End )
+  {
+    IAP_Status = IAP_WRITE_FAILED;
+    return HAL_ERROR;
+  }
+  p_output[Output_Fill++] = value;
+  if( (Output_Fill < FLASH_PAGE_SIZE) && (Output_Page + Output_Fill < Image_End) )
+  {
+    return HAL_OK;
+  }
+  return IAP_Decompress_Commit();
+}
+
+/**********************************************
+  Name: IAP_Decompress_Commit
+  Description: commits the output buffer to its
+        flash page, erasing the page and writing
+        it once more if that fails, and moves on
+        to the next page once a whole one is in.
+**********************************************/
+HAL_StatusTypeDef IAP_Decompress_Commit( void )
+{
+  uint8_t *p_output = (uint8_t*) Output_Buffer;
+  uint16_t fill;
+  
+  // Round the last page up to whole double words
+  for( fill = Output_Fill; (fill & 0x07) != 0; fill++ )
+  {
+    p_output[fill] = 0xFF;
+  }
+  if( IAP_Commit_Page(Output_Page, Output_Buffer, fill >> 3) != HAL_OK )
+  {
+    if( (IAP_Status == IAP_IMAGE_TOO_LARGE) || (IAP_Erase_Flash_Memory(Output_Page, 1) != HAL_OK) )
+    {
+      return HAL_ERROR;
+    }
+    Telemetry[IAP_TELEMETRY_PROGRAM_RETRIES] ++;
+    if( IAP_Commit_Page(Output_Page, Output_Buffer, fill >> 3) != HAL_OK )
+    {
+      return HAL_ERROR;
+    }
+  }
+  if( Output_Fill == FLASH_PAGE_SIZE )
+  {
+    Output_Page += FLASH_PAGE_SIZE;
+    Output_Fill = 0;
+  }
+  return HAL_OK;
 }
 
 /**********************************************
-  Name: IAP_Calculate_CRC16
-  Description: While program is transfering
-        this function is called to update the 
-        CRC to assure that the program that was 
-        transfered is valid. 
+  Name: IAP_Decompress_Save
+  Description: compressed transfers. Keeps the
+        decoder state and the partly filled 
+        output page from before a block, for 
+        IAP_Decompress_Restore.
+**********************************************/
+void IAP_Decompress_Save( void )
+{
+  LZ_Saved.Output_Page = Output_Page;
+  LZ_Saved.Output_Fill = Output_Fill;
+  LZ_Saved.Flags = LZ_Flags;
+  LZ_Saved.Flag_Count = LZ_Flag_Count;
+  LZ_Saved.Token = LZ_Token;
+  LZ_Saved.Have_Token = LZ_Have_Token;
+  memcpy( Output_Saved, Output_Buffer, Output_Fill );
+}
 
-        Uses CRC16_CCITT_ZERO (XModem)
+/**********************************************
+  Name: IAP_Decompress_Restore
+  Description: compressed transfers. Puts the 
+        decoder back where it was before the 
+        block that failed and erases the flash
+        pages that block wrote, so the resent 
+        block is decoded into them again.
 **********************************************/
-uint16_t IAP_Calculate_CRC16( uint16_t crc, uint8_t data )
+HAL_StatusTypeDef IAP_Decompress_Restore( void )
+{
+  uint32_t end = Output_Page + FLASH_PAGE_SIZE;
+  HAL_StatusTypeDef status = HAL_OK;
+  
+  // Pages past Erased_Up_To were never written
+  IAP_Wait_For_Erase();
+  if( end > Erased_Up_To )
+  {
+    end = Erased_Up_To;
+  }
+  if( end > LZ_Saved.Output_Page )
+  {
+    status = IAP_Erase_Flash_Memory( LZ_Saved.Output_Page, (end - LZ_Saved.Output_Page) / FLASH_PAGE_SIZE );
+  }
+  Output_Page = LZ_Saved.Output_Page;
+  Output_Fill = LZ_Saved.Output_Fill;
+  LZ_Flags = LZ_Saved.Flags;
+  LZ_Flag_Count = LZ_Saved.Flag_Count;
+  LZ_Token = LZ_Saved.Token;
+  LZ_Have_Token = LZ_Saved.Have_Token;
+  memcpy( Output_Buffer, Output_Saved, Output_Fill );
+  return status;
+}
+
+/**********************************************
+  Name: IAP_Send_Node_Info
+  Description: broadcast downloads. Answers a 
+        node query with the node ID, download 
+        slot and unique ID hash on this node's
+        response ID, so the host can find every
+        node on the bus.
+**********************************************/
+void IAP_Send_Node_Info( void )
+{
+  uint8_t payload[8];
+  
+  payload[0] = IAP_NODE_INFO;
+  payload[1] = Node_ID;
+  payload[2] = IAP_Slot_Number( IAP_Inactive_Slot() );
+  payload[3] = Node_UID_Hash >> 24;
+  payload[4] = (Node_UID_Hash >> 16) & 0xFF;
+  payload[5] = (Node_UID_Hash >> 8) & 0xFF;
+  payload[6] = Node_UID_Hash & 0xFF;
+  payload[7] = 0;
+  IAP_CAN_Send(CAN_IAP_NODE_RESPONSE_BASE + Node_ID, CAN_ID_STD, payload, 7);
+}
+
+/**********************************************
+  Name: IAP_Stage_Sequenced_Frame
+  Description: stages a data frame that carries
+        its page and frame index in the extended
+        ID at that index, and marks it received
+        so lost frames can be resent on their 
+        own. A frame for another page clears the
+        received bitmap and starts the page over.
+**********************************************/
+void IAP_Stage_Sequenced_Frame( uint32_t extId, uint8_t RxMessage[] )
+{
+  uint16_t page = (extId >> 8) & 0x3FF;
+  uint16_t frame = extId & 0xFF;
+  
+  if( page != Seq_Page )
+  {
+    IAP_Clear_Received();
+    Seq_Page = page;
+    Address_in_Page = 0;
+  }
+  memcpy( &Page_Buffer[frame], RxMessage, 8 );
+  Rx_Bitmap[frame >> 5] |= 1UL << (frame & 0x1F);
+  if( frame >= Address_in_Page )
+  {
+    Address_in_Page = frame + 1;
+  }
+}
+
+/**********************************************
+  Name: IAP_Send_Missing_Frames
+  Description: lists the frames below 
+        NbrOfFrames that have not been received
+        for the page being staged, up to 6 per
+        IAP_MISSING_FRAMES frame.
+**********************************************/
+void IAP_Send_Missing_Frames( uint16_t NbrOfFrames )
 {
-  char j;
-  crc = crc ^ (data << 8);
-  for(j = 0; j < 8; j++)
+  uint8_t payload[8];
+  uint16_t frame, missing = 0;
+  uint8_t listed = 0;
+  uint8_t count = 2;
+  
+  if( NbrOfFrames > IAP_PAGE_BUFFER_FRAMES )
+  {
+    NbrOfFrames = IAP_PAGE_BUFFER_FRAMES;
+  }
+  for( frame = 0; frame < NbrOfFrames; frame++ )
   {
-    if((crc & 0x8000) > 0)
+    if( (Rx_Bitmap[frame >> 5] & (1UL << (frame & 0x1F))) == 0 )
     {
-      crc = (crc << 1) ^ 0x1021;
+      missing ++;
     }
-    else
+  }
+  payload[0] = IAP_MISSING_FRAMES;
+  payload[1] = ( missing > 0xFF ) ? 0xFF : missing;
+  payload[2] = payload[3] = payload[4] = payload[5] = payload[6] = payload[7] = 0;
+  for( frame = 0; (frame < NbrOfFrames) && (listed < IAP_MISSING_REPORT_MAX); frame++ )
+  {
+    if( (Rx_Bitmap[frame >> 5] & (1UL << (frame & 0x1F))) != 0 )
+    {
+      continue;
+    }
+    payload[count++] = frame;
+    listed ++;
+    if( count == 8 )
     {
-      crc = crc << 1;
+      IAP_CAN_Send(CAN_IAP_CRC, CAN_ID_STD, payload, count);
+      count = 2;
     }
   }
-  return crc;
+  // The last (or only) frame is shorter, which tells the host the list is done
+  IAP_CAN_Send(CAN_IAP_CRC, CAN_ID_STD, payload, count);
 }
 
 /**********************************************
-  Name: IAP_WriteFrameToFlash
-  Description: Receives CAN message and writes
-        CAN payload to flash memory in temporary
-        location.
+  Name: IAP_Frames_Received
+  Description: returns 1 if every frame below 
+        NbrOfFrames of the page being staged has
+        been received, 0 otherwise.
 **********************************************/
-HAL_StatusTypeDef IAP_WriteFrameToFlash( uint32_t destination, uint32_t *p_source, uint32_t *p_source2 )
+uint8_t IAP_Frames_Received( uint16_t NbrOfFrames )
 {
-  uint64_t Data = *p_source;
-  uint64_t Data2 = *p_source2;
-  HAL_StatusTypeDef status = HAL_ERROR;  
-  IAP_Status = IAP_WRITE_BUSY;
-  Data = ( Data2 << 32 ) | Data;
-  uint8_t flashWriteLoopCounter = 0;
-  while ( status != HAL_OK )
+  uint16_t frame;
+  
+  for( frame = 0; frame < NbrOfFrames; frame++ )
   {
-    if( flashWriteLoopCounter > 10 )
+    if( (Rx_Bitmap[frame >> 5] & (1UL << (frame & 0x1F))) == 0 )
     {
-      IAP_Status = IAP_WRITE_FAILED;
-      return HAL_ERROR;
+      return 0;
     }
-    HAL_FLASH_Unlock();    
-    status = HAL_FLASH_Program( FLASH_TYPEPROGRAM_DOUBLEWORD, destination, Data ); 
-    HAL_FLASH_Lock();
-    flashWriteLoopCounter ++;
-    IAP_Status = IAP_WRITE_SUCCEEDED;
   }
+  return 1;
+}
+
+/**********************************************
+  Name: IAP_Clear_Received
+  Description: starts a new page, no frame of it
+        has been received yet.
+**********************************************/
+void IAP_Clear_Received( void )
+{
+  memset( Rx_Bitmap, 0, sizeof(Rx_Bitmap) );
+  Seq_Page = 0xFFFF;
+}
+
+/**********************************************
+  Name: IAP_Send_Telemetry
+  Description: sends every telemetry counter, 
+        one IAP_TELEMETRY frame each, and clears
+        them afterwards if clear is 1.
+**********************************************/
+void IAP_Send_Telemetry( uint8_t clear )
+{
+  uint8_t payload[8];
+  uint8_t i;
+  uint32_t value;
+  
+  Telemetry[IAP_TELEMETRY_QUEUE_OVERRUNS] = IAP_Rx_Queue_Overruns;
+  Telemetry[IAP_TELEMETRY_FIFO_OVERRUNS] = IAP_Rx_FIFO_Overruns;
+  Telemetry[IAP_TELEMETRY_CONTROL_HITS] = CAN_Filter_Hits[CAN_FILTER_CONTROL];
+  Telemetry[IAP_TELEMETRY_DATA_HITS] = CAN_Filter_Hits[CAN_FILTER_DATA];
+  Telemetry[IAP_TELEMETRY_SEQUENCED_HITS] = CAN_Filter_Hits[CAN_FILTER_SEQUENCED];
+  Telemetry[IAP_TELEMETRY_COMMAND_HITS] = CAN_Filter_Hits[CAN_FILTER_COMMAND];
+  Telemetry[IAP_TELEMETRY_CONTROL_OVERRUNS] = IAP_Rx_Control_Overruns;
+  Telemetry[IAP_TELEMETRY_TX_OVERRUNS] = IAP_Tx_Queue_Overruns;
+  Telemetry[IAP_TELEMETRY_RX_ISR_CYCLES] = CAN_Rx_ISR_Cycles;
+  Telemetry[IAP_TELEMETRY_RX_ISR_FRAMES] = CAN_Rx_ISR_Frames;
+  for( i = 0; i < IAP_TELEMETRY_COUNTERS; i++ )
+  {
+    value = Telemetry[i];
+    payload[0] = IAP_TELEMETRY;
+    payload[1] = i;
+    payload[2] = value >> 24;
+    payload[3] = (value >> 16) & 0xFF;
+    payload[4] = (value >> 8) & 0xFF;
+    payload[5] = value & 0xFF;
+    payload[6] = IAP_TELEMETRY_COUNTERS;
+    payload[7] = 0;
+    IAP_CAN_Send(CAN_IAP_CRC, CAN_ID_STD, payload, 7);
+  }
+  if( clear == 1 )
+  {
+    memset( Telemetry, 0, sizeof(Telemetry) );
+    IAP_Rx_Queue_Overruns = 0;
+    IAP_Rx_FIFO_Overruns = 0;
+    IAP_Rx_Control_Overruns = 0;
+    IAP_Tx_Queue_Overruns = 0;
+    memset( (void *) CAN_Filter_Hits, 0, sizeof(CAN_Filter_Hits) );
+    CAN_Rx_ISR_Cycles = 0;
+    CAN_Rx_ISR_Frames = 0;
+  }
+}
+
+/**********************************************
+  Name: IAP_Journal_Scan
+  Description: reads the progress journal after
+        a reset to find the download that was 
+        interrupted, if any, and where the next
+        record goes.
+**********************************************/
+void IAP_Journal_Scan( void )
+{
+  uint32_t *p_record;
+  
+  Resume_Frames = 0;
+  Resume_Length = 0;
+  Resume_Slot = IAP_SLOT_NONE;
+  for( Journal_Next = IAP_JOURNAL_START; Journal_Next < IAP_JOURNAL_END; Journal_Next += 8 )
+  {
+    p_record = (uint32_t*) Journal_Next;
+    if( (p_record[0] == 0xFFFFFFFF) && (p_record[1] == 0xFFFFFFFF) )
+    {
+      break;
+    }
+    if( p_record[0] == IAP_JOURNAL_TRANSFER )
+    {
+      Resume_Slot = p_record[1] >> 24;
+      Resume_Length = p_record[1] & 0xFFFFFF;
+      Resume_Frames = 0;
+    }
+    else if( p_record[0] == IAP_JOURNAL_PAGE )
+    {
+      Resume_Frames = p_record[1];
+    }
+    else if( p_record[0] == IAP_JOURNAL_DONE )
+    {
+      Resume_Length = 0;
+      Resume_Frames = 0;
+    }
+  }
+  // The download has to go on into the same slot
+  if( (Resume_Length == 0) || (Resume_Slot != IAP_Slot_Number(IAP_Inactive_Slot())) )
+  {
+    Resume_Frames = 0;
+    Resume_Length = 0;
+  }
+}
+
+/**********************************************
+  Name: IAP_Journal_Append
+  Description: appends one record to the 
+        progress journal. Does nothing once the
+        journal page is full or a record could 
+        not be written.
+**********************************************/
+HAL_StatusTypeDef IAP_Journal_Append( uint32_t tag, uint32_t value )
+{
+  HAL_StatusTypeDef status;
+  
+  if( Journal_Next >= IAP_JOURNAL_END )
+  {
+    return HAL_ERROR;
+  }
+  IAP_Wait_For_Erase();
+  HAL_FLASH_Unlock();
+  status = IAP_Flash_Program( Journal_Next, ((uint64_t) value << 32) | tag );
+  HAL_FLASH_Lock();
+  if( status != HAL_OK )
+  {
+    // A failed record can read back erased and the scan stops there, so later records
+    // would never be found. Resuming from the last good one only resends some pages
+    Journal_Next = IAP_JOURNAL_END;
+    return status;
+  }
+  Journal_Next += 8;
   return status;
 }
 
 /**********************************************
-  Name: IAP_Erase_Flash_Memory
-  Description: erases user memory from start for NbrOfPages
-        length, pausing all other
-        tasks to ensure data integrity.
+  Name: IAP_Resume
+  Description: continues the interrupted raw 
+        download from frame, which has to be 
+        the committed progress read from the 
+        journal, with transfer blocks of 
+        blockPages flash pages. Answers with 
+        IAP_RESUME_STATUS holding the frame it 
+        resumes from, 0 if the download has to 
+        start over.
 **********************************************/
-HAL_StatusTypeDef IAP_Erase_Flash_Memory( uint32_t start, uint8_t NbrOfPages )
+void IAP_Resume( uint32_t frame, uint8_t blockPages )
+{
+  uint8_t payload[8];
+  uint32_t committedEnd = IAP_Inactive_Slot() + (frame << 3);
+  uint32_t pageEnd = FLASH_START_ADDRESS + 
+                     ((committedEnd - FLASH_START_ADDRESS + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE) * FLASH_PAGE_SIZE;
+  uint32_t address;
+  
+  IAP_Wait_For_Erase();
+  IAP_Block_Size( blockPages );
+  // Block numbers count from the start of the image, so the blocks have to line up
+  if( (frame == 0) || (frame != Resume_Frames) || (frame % Block_Frames != 0) )
+  {
+    frame = 0;
+  }
+  // The rest of the last page must still be erased, a commit may have been cut short
+  for( address = committedEnd; (frame != 0) && (address < pageEnd); address += 4 )
+  {
+    if( *(uint32_t*) address != 0xFFFFFFFF )
+    {
+      frame = 0;
+    }
+  }
+  if( frame != 0 )
+  {
+    Slot_Address = IAP_Inactive_Slot();
+    Image_End = Slot_Address + Resume_Length;
+    Erased_Up_To = pageEnd;
+    Transfer_Mode = IAP_TRANSFER_RAW;
+    Broadcast = IAP_BROADCAST_OFF;
+    Image_Version = IAP_VERSION_UNKNOWN;
+    // A header sent again before the resume still names the version and CRC32
+    if( (Image_Header_Words == (1 << IAP_HEADER_WORDS) - 1) && (Image_Header.Magic == IAP_HEADER_MAGIC) &&
+        (Image_Header.Image_Length == Resume_Length) )
+    {
+      Image_Version = Image_Header.Firmware_Version;
+      Image_CRC32 = Image_Header.Image_CRC32;
+      Image_CRC32_Set = 1;
+    }
+    iteration = frame;
+    Address_in_Page = 0;
+    Program_CRC = 0;
+    Is_Last_Frame = 0;
+    Window_Size = 0;
+    Window_Discard = 0;
+    IAP_Clear_Received();
+    // What was committed before the reset is hashed once, here
+    IAP_SHA256_Init( &Image_Hash );
+    Hash_Up_To = Slot_Address;
+    IAP_Hash_Committed( Slot_Address, committedEnd );
+  }
+  payload[0] = IAP_RESUME_STATUS;
+  payload[1] = frame >> 16;
+  payload[2] = (frame >> 8) & 0xFF;
+  payload[3] = frame & 0xFF;
+  payload[4] = Resume_Length >> 16;
+  payload[5] = (Resume_Length >> 8) & 0xFF;
+  payload[6] = Resume_Length & 0xFF;
+  payload[7] = 0;
+  IAP_CAN_Send(CAN_IAP_CRC, CAN_ID_STD, payload, 7);
+}
+
+/**********************************************
+  Name: IAP_Erase_Ahead
+  Description: makes sure flash is erased up to
+        end before it is programmed, erasing 
+        only the pages this transfer has not 
+        already erased. Refuses to go past the
+        end of the image.
+**********************************************/
+HAL_StatusTypeDef IAP_Erase_Ahead( uint32_t end )
+{
+  uint32_t NbrOfPages;
+  
+  IAP_Wait_For_Erase();
+  if( end > Image_End )
+  {
+    IAP_Status = IAP_IMAGE_TOO_LARGE;
+    return HAL_ERROR;
+  }
+  if( end <= Erased_Up_To )
+  {
+    return HAL_OK;
+  }
+  NbrOfPages = (end - Erased_Up_To + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+  if( IAP_Erase_Flash_Memory(Erased_Up_To, NbrOfPages) != HAL_OK )
+  {
+    return HAL_ERROR;
+  }
+  Erased_Up_To += NbrOfPages * FLASH_PAGE_SIZE;
+  return HAL_OK;
+}
+
+/**********************************************
+  Name: IAP_Erase_Next_Page_IT
+  Description: starts an interrupt driven erase
+        of the next unerased flash page of the
+        image, as long as it is no more than 
+        IAP_ERASE_AHEAD_PAGES past the page 
+        being received. Returns straight away, 
+        the flash interrupt finishes the erase.
+**********************************************/
+void IAP_Erase_Next_Page_IT( void )
 {
-  uint8_t flashEraseLoopCounter = 0;
   FLASH_EraseInitTypeDef pEraseInit;
-  uint32_t PageEraseStatus = 0;
+  uint32_t limit = Slot_Address + ((iteration + Block_Frames) << 3) 
+                   + IAP_ERASE_AHEAD_PAGES * FLASH_PAGE_SIZE;
+  
+  if( Transfer_Mode == IAP_TRANSFER_COMPRESSED )
+  {
+    // Output runs ahead of the compressed input
+    limit = Output_Page + (1 + IAP_ERASE_AHEAD_PAGES) * FLASH_PAGE_SIZE;
+  }  
+  if( Erase_Busy || (Erased_Up_To >= Image_End) || (Erased_Up_To >= limit) )
+  {
+    return;
+  }
+  Erase_Page_Address = Erased_Up_To;
   pEraseInit.Banks = FLASH_BANK_1;
-  pEraseInit.NbPages = NbrOfPages % FLASH_PAGE_NBPERBANK;
-  pEraseInit.Page = FLASH_PAGE_NBPERBANK - pEraseInit.NbPages;
+  pEraseInit.NbPages = 1;
+  pEraseInit.Page = (Erase_Page_Address - FLASH_START_ADDRESS) / FLASH_PAGE_SIZE;
   pEraseInit.TypeErase = FLASH_TYPEERASE_PAGES;
+  Erase_Busy = 1;
+  HAL_FLASH_Unlock();
+  if( HAL_FLASHEx_Erase_IT(&pEraseInit) != HAL_OK )
+  {
+    Erase_Busy = 0;
+    HAL_FLASH_Lock();
+  }
+}
+
+/**********************************************
+  Name: IAP_Wait_For_Erase
+  Description: blocks until a background erase
+        started by IAP_Erase_Next_Page_IT has
+        finished so flash can be used again.
+**********************************************/
+void IAP_Wait_For_Erase( void )
+{
+  uint32_t cycles = DWT->CYCCNT;
+  while( Erase_Busy )
+  {
+  }
+  Telemetry[IAP_TELEMETRY_ERASE_CYCLES] += DWT->CYCCNT - cycles;
+  // A failed background erase is simply redone by IAP_Erase_Ahead
+  if( Erase_Error )
+  {
+    Telemetry[IAP_TELEMETRY_ERASE_RETRIES] ++;
+  }
+  Erase_Error = 0;
+}
+
+/**********************************************
+  Name: HAL_FLASH_EndOfOperationCallback
+  Description: flash interrupt, the background 
+        page erase finished.
+**********************************************/
+void HAL_FLASH_EndOfOperationCallback( uint32_t ReturnValue )
+{
+  if( ReturnValue == PAGE_ERASE_SUCCESS )
+  {
+    Erased_Up_To = Erase_Page_Address + FLASH_PAGE_SIZE;
+    HAL_FLASH_Lock();
+    Erase_Busy = 0;
+  }
+}
+
+/**********************************************
+  Name: HAL_FLASH_OperationErrorCallback
+  Description: flash interrupt, the background 
+        page erase failed. Erased_Up_To is left
+        alone so the page is erased again.
+**********************************************/
+void HAL_FLASH_OperationErrorCallback( uint32_t ReturnValue )
+{
+  Erase_Error = 1;
+  HAL_FLASH_Lock();
+  Erase_Busy = 0;
+}
+
+/**********************************************
+  Name: IAP_Erase_Flash_Memory
+  Description: erases user memory from start for NbrOfPages
+        length, a page at a time from RAM so the
+        CAN receive interrupt keeps running.
+**********************************************/
+HAL_StatusTypeDef IAP_Erase_Flash_Memory( uint32_t start, uint8_t NbrOfPages )
+{
+  uint8_t flashEraseLoopCounter;
+  uint8_t i;
+  uint32_t cycles;
+  
+  IAP_Wait_For_Erase();
+  cycles = DWT->CYCCNT;
   HAL_FLASH_Unlock();    
-  __disable_irq();
-  while (PageEraseStatus != PAGE_ERASE_SUCCESS)
+  for( i = 0; i < NbrOfPages; i++ )
   {
-    if( flashEraseLoopCounter > 10 )
+    flashEraseLoopCounter = 0;
+    while( IAP_Flash_Erase_Page(start + (i * FLASH_PAGE_SIZE)) != HAL_OK )
     {
-      IAP_Status = IAP_ERASE_FAILED;
-      return HAL_ERROR;
+      if( ++flashEraseLoopCounter > 10 )
+      {
+        IAP_Status = IAP_ERASE_FAILED;
+        HAL_FLASH_Lock();
+        Telemetry[IAP_TELEMETRY_ERASE_CYCLES] += DWT->CYCCNT - cycles;
+        return HAL_ERROR;
+      }
+      Telemetry[IAP_TELEMETRY_ERASE_RETRIES] ++;
     }
-    HAL_FLASHEx_Erase( &pEraseInit, &PageEraseStatus );
-    flashEraseLoopCounter ++;
   }
-  __enable_irq();
   HAL_FLASH_Lock();
+  Telemetry[IAP_TELEMETRY_ERASE_CYCLES] += DWT->CYCCNT - cycles;
   return HAL_OK;
 }
   
+/**********************************************
+  Name: IAP_Flash_Erase_Page
+  Description: erases the flash page at address
+        from RAM, polling BSY with interrupts 
+        enabled, and resets the flash caches 
+        afterwards as HAL_FLASHEx_Erase does.
+        Flash has to be unlocked.
+**********************************************/
+__ramfunc HAL_StatusTypeDef IAP_Flash_Erase_Page( uint32_t address )
+{
+  uint32_t acr = FLASH->ACR;
+  uint32_t errors;
+  
+  while( READ_BIT(FLASH->SR, FLASH_SR_BSY) )
+  {
+  }
+  __HAL_FLASH_CLEAR_FLAG( FLASH_FLAG_SR_ERRORS );
+  // Lines of the old page must not be served from the caches afterwards
+  CLEAR_BIT( FLASH->ACR, FLASH_ACR_ICEN | FLASH_ACR_DCEN );
+  MODIFY_REG( FLASH->CR, FLASH_CR_PNB, ((address - FLASH_START_ADDRESS) / FLASH_PAGE_SIZE) << FLASH_CR_PNB_Pos );
+  SET_BIT( FLASH->CR, FLASH_CR_PER );
+  SET_BIT( FLASH->CR, FLASH_CR_STRT );
+  while( READ_BIT(FLASH->SR, FLASH_SR_BSY) )
+  {
+  }
+  CLEAR_BIT( FLASH->CR, FLASH_CR_PER | FLASH_CR_PNB );
+  errors = FLASH->SR & FLASH_FLAG_SR_ERRORS;
+  SET_BIT( FLASH->ACR, FLASH_ACR_ICRST | FLASH_ACR_DCRST );
+  CLEAR_BIT( FLASH->ACR, FLASH_ACR_ICRST | FLASH_ACR_DCRST );
+  FLASH->ACR = acr;
+  return ( errors == 0 ) ? HAL_OK : HAL_ERROR;
+}
+
+/**********************************************
+  Name: IAP_Flash_Program
+  Description: programs one double word from 
+        RAM, polling BSY with interrupts enabled.
+        Flash has to be unlocked.
+**********************************************/
+__ramfunc HAL_StatusTypeDef IAP_Flash_Program( uint32_t address, uint64_t data )
+{
+  uint32_t errors;
+  
+  while( READ_BIT(FLASH->SR, FLASH_SR_BSY) )
+  {
+  }
+  __HAL_FLASH_CLEAR_FLAG( FLASH_FLAG_SR_ERRORS );
+  SET_BIT( FLASH->CR, FLASH_CR_PG );
+  *(__IO uint32_t*) address = (uint32_t) data;
+  __ISB();
+  *(__IO uint32_t*) (address + 4) = (uint32_t) (data >> 32);
+  while( READ_BIT(FLASH->SR, FLASH_SR_BSY) )
+  {
+  }
+  CLEAR_BIT( FLASH->CR, FLASH_CR_PG );
+  errors = FLASH->SR & FLASH_FLAG_SR_ERRORS;
+  return ( errors == 0 ) ? HAL_OK : HAL_ERROR;
+}
+
+/**********************************************
+  Name: IAP_Flash_Program_Row
+  Description: fast programs one 32 double word
+        row from RAM. A late double word aborts
+        the row, so only interrupts above 
+        IAP_FLASH_BASEPRI (CAN, running from RAM)
+        are taken while it is written. Flash has
+        to be unlocked.
+**********************************************/
+__ramfunc HAL_StatusTypeDef IAP_Flash_Program_Row( uint32_t address, const uint64_t *p_source )
+{
+  __IO uint32_t *p_destination = (__IO uint32_t*) address;
+  const uint32_t *p_words = (const uint32_t*) p_source;
+  uint32_t basepri = __get_BASEPRI();
+  uint32_t errors;
+  uint8_t i;
+  
+  while( READ_BIT(FLASH->SR, FLASH_SR_BSY) )
+  {
+  }
+  __HAL_FLASH_CLEAR_FLAG( FLASH_FLAG_SR_ERRORS );
+  SET_BIT( FLASH->CR, FLASH_CR_FSTPG );
+  __set_BASEPRI( IAP_FLASH_BASEPRI );
+  for( i = 0; i < 2 * IAP_FLASH_ROW_FRAMES; i++ )
+  {
+    p_destination[i] = p_words[i];
+  }
+  __set_BASEPRI( basepri );
+  while( READ_BIT(FLASH->SR, FLASH_SR_BSY) )
+  {
+  }
+  CLEAR_BIT( FLASH->CR, FLASH_CR_FSTPG );
+  errors = FLASH->SR & FLASH_FLAG_SR_ERRORS;
+  return ( errors == 0 ) ? HAL_OK : HAL_ERROR;
+}
+
 /**********************************************
   Name: IAP_Reset_IAP_Markers
   Description: resets the IAP Markers that tell
@@ -433,26 +2972,113 @@ HAL_StatusTypeDef IAP_Reset_IAP_Markers( void )
 
 /**********************************************
   Name: IAP_CAN_Send
-  Description: Sends one CAN frame
+  Description: Queues one CAN frame in the 
+        transmit ring and returns without 
+        waiting for a mailbox, the frame is 
+        dropped and counted if the ring is 
+        full. During a broadcast download the 
+        IAP answers go out on this node's 
+        response ID. Runs from RAM, 
+        IAP_Control_Frame answers from the CAN
+        interrupt.
+**********************************************/
+__ramfunc void IAP_CAN_Send( uint16_t standardID, uint8_t ide, uint8_t payload[8], uint8_t dlc )
+{
+  IAP_Tx_Frame *p_frame;
+  uint16_t head;
+  uint32_t primask;
+  uint8_t i;
+  
+  if( (Broadcast == IAP_BROADCAST_ON) && 
+      ((standardID == CAN_IAP_UPDATE_FIRMWARE) || (standardID == CAN_IAP_CRC)) )
+  {
+    // Answers from every node on one ID would collide
+    standardID = CAN_IAP_NODE_RESPONSE_BASE + Node_ID;
+  }
+  // The control FIFO interrupt sends too, a few instructions with interrupts masked
+  primask = __get_PRIMASK();
+  __disable_irq();
+  head = IAP_Tx_Head;
+  if( (uint16_t) (head - IAP_Tx_Tail) >= IAP_TX_QUEUE_SIZE )
+  {
+    IAP_Tx_Queue_Overruns ++;
+  }
+  else
+  {
+    p_frame = &IAP_Tx_Queue[head & (IAP_TX_QUEUE_SIZE - 1)];
+    p_frame->StdId = standardID;
+    p_frame->DLC = dlc;
+    for( i = 0; i < 8; i++ )
+    {
+      p_frame->Data[i] = payload[i];
+    }
+    IAP_Tx_Head = head + 1;
+    IAP_CAN_Drain_Tx();
+  }
+  __set_PRIMASK( primask );
+}
+
+/**********************************************
+  Name: IAP_CAN_Drain_Tx
+  Description: moves frames from the transmit 
+        ring into the free TX mailboxes. Called
+        by IAP_CAN_Send and from the mailbox 
+        complete interrupts, so all three 
+        mailboxes stay busy while answers are 
+        queued. Callers in thread mode mask 
+        interrupts around it. Runs from RAM.
 **********************************************/
-void IAP_CAN_Send( uint16_t standardID, uint8_t ide, uint8_t payload[8], uint8_t dlc )
+__ramfunc void IAP_CAN_Drain_Tx( void )
 {
-  uint32_t TxMailbox;
-  CAN_TxHeaderTypeDef   TxHeader;
-  TxHeader.StdId = standardID;
-  TxHeader.ExtId = 0x01;
-  TxHeader.RTR = CAN_RTR_DATA;
-  TxHeader.IDE = CAN_ID_STD;
-  TxHeader.DLC = dlc;
-  TxHeader.TransmitGlobalTime = DISABLE;
-  while( HAL_CAN_GetTxMailboxesFreeLevel(CAN_Handle) == 0 )
+  CAN_TypeDef *can = CAN_Handle->Instance;
+  CAN_TxMailBox_TypeDef *p_mailbox;
+  IAP_Tx_Frame *p_frame;
+  uint16_t tail = IAP_Tx_Tail;
+  uint32_t tsr;
+  
+  if( CAN_Handle->State != HAL_CAN_STATE_LISTENING )
   {
-    // Waiting for Mailbox to become free.
+    // CAN not started yet, the frames wait in the ring
+    return;
   }
-  if (HAL_CAN_AddTxMessage(CAN_Handle, &TxHeader, payload, &TxMailbox) != HAL_OK)
+  // Straight from the registers like CAN1_Rx_Drain, the HAL is not in RAM
+  while( tail != IAP_Tx_Head )
   {
-    /* Transmission request Error */
-    Error_Handler();
+    tsr = can->TSR;
+    if( (tsr & (CAN_TSR_TME0 | CAN_TSR_TME1 | CAN_TSR_TME2)) == 0 )
+    {
+      break;
+    }
+    // CODE is the next empty mailbox
+    p_mailbox = &can->sTxMailBox[(tsr & CAN_TSR_CODE) >> CAN_TSR_CODE_Pos];
+    p_frame = &IAP_Tx_Queue[tail & (IAP_TX_QUEUE_SIZE - 1)];
+    p_mailbox->TDTR = p_frame->DLC;
+    p_mailbox->TDLR = ((uint32_t) p_frame->Data[3] << 24) | ((uint32_t) p_frame->Data[2] << 16) |
+                      ((uint32_t) p_frame->Data[1] << 8) | p_frame->Data[0];
+    p_mailbox->TDHR = ((uint32_t) p_frame->Data[7] << 24) | ((uint32_t) p_frame->Data[6] << 16) |
+                      ((uint32_t) p_frame->Data[5] << 8) | p_frame->Data[4];
+    // Standard data frame, setting TXRQ hands it to the controller
+    p_mailbox->TIR = ((uint32_t) p_frame->StdId << CAN_TI0R_STID_Pos) | CAN_TI0R_TXRQ;
+    tail ++;
   }
+  IAP_Tx_Tail = tail;
 }
 
+/**********************************************
+  Name: IAP_CAN_Flush
+  Description: waits until the transmit ring 
+        and the TX mailboxes are empty, at most
+        IAP_TX_FLUSH_TIMEOUT ms. Called before 
+        a reset or a jump so the last answers 
+        still go out.
+**********************************************/
+void IAP_CAN_Flush( void )
+{
+  uint32_t start = HAL_GetTick();
+  
+  while( ((IAP_Tx_Tail != IAP_Tx_Head) || 
+          (HAL_CAN_GetTxMailboxesFreeLevel(CAN_Handle) < IAP_TX_MAILBOXES)) &&
+         (HAL_GetTick() - start < IAP_TX_FLUSH_TIMEOUT) )
+  {
+  }
+}
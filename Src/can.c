@@ -21,7 +21,11 @@
 #include "can.h"
 
 /* USER CODE BEGIN 0 */
+#include "IAP.h"
 
+volatile uint32_t CAN_Filter_Hits[CAN_FILTERS];
+volatile uint32_t CAN_Rx_ISR_Cycles;
+volatile uint32_t CAN_Rx_ISR_Frames;
 /* USER CODE END 0 */
 
 CAN_HandleTypeDef hcan1;
@@ -78,6 +82,8 @@ void HAL_CAN_MspInit(CAN_HandleTypeDef* canHandle)
     HAL_NVIC_EnableIRQ(CAN1_TX_IRQn);
     HAL_NVIC_SetPriority(CAN1_RX0_IRQn, 0, 0);
     HAL_NVIC_EnableIRQ(CAN1_RX0_IRQn);
+    HAL_NVIC_SetPriority(CAN1_RX1_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(CAN1_RX1_IRQn);
   /* USER CODE BEGIN CAN1_MspInit 1 */
 
   /* USER CODE END CAN1_MspInit 1 */
@@ -104,6 +110,7 @@ void HAL_CAN_MspDeInit(CAN_HandleTypeDef* canHandle)
     /* CAN1 interrupt Deinit */
     HAL_NVIC_DisableIRQ(CAN1_TX_IRQn);
     HAL_NVIC_DisableIRQ(CAN1_RX0_IRQn);
+    HAL_NVIC_DisableIRQ(CAN1_RX1_IRQn);
   /* USER CODE BEGIN CAN1_MspDeInit 1 */
 
   /* USER CODE END CAN1_MspDeInit 1 */
@@ -111,7 +118,171 @@ void HAL_CAN_MspDeInit(CAN_HandleTypeDef* canHandle)
 } 
 
 /* USER CODE BEGIN 1 */
+/**
+  * @brief  Sets up the IAP acceptance filters. Standard IDs are matched 
+  *         exactly with ID list banks, the sequenced data frames carry the
+  *         page and frame in their extended ID so they take a mask bank.
+  * @retval HAL status
+  */
+HAL_StatusTypeDef CAN1_Filter_Init(void)
+{
+  CAN_FilterTypeDef FilterConfig;
+  uint32_t id = ((uint32_t) CAN_IAP_UPDATE_FIRMWARE << (IAP_SEQUENCED_ID_SHIFT + 3)) | CAN_ID_EXT;
+  uint32_t mask = ((uint32_t) 0x7FF << 21) | CAN_ID_EXT | CAN_RTR_REMOTE;
+
+  FilterConfig.FilterMode = CAN_FILTERMODE_IDLIST;
+  FilterConfig.FilterScale = CAN_FILTERSCALE_16BIT;
+  FilterConfig.FilterActivation = CAN_FILTER_ENABLE;
+  FilterConfig.SlaveStartFilterBank = 14;
+
+  // Control, the ID fills all four elements of the list
+  FilterConfig.FilterIdHigh = CAN_FILTER_STD(CAN_IAP_CONTROL);
+  FilterConfig.FilterIdLow = CAN_FILTER_STD(CAN_IAP_CONTROL);
+  FilterConfig.FilterMaskIdHigh = CAN_FILTER_STD(CAN_IAP_CONTROL);
+  FilterConfig.FilterMaskIdLow = CAN_FILTER_STD(CAN_IAP_CONTROL);
+  FilterConfig.FilterFIFOAssignment = CAN_FILTER_FIFO1;
+  FilterConfig.FilterBank = CAN_FILTER_BANK_CONTROL;
+  if (HAL_CAN_ConfigFilter(&hcan1, &FilterConfig) != HAL_OK)
+  {
+    return HAL_ERROR;
+  }
+
+  // Commands (FR1) and bulk data (FR2) in one FIFO, in the order they were sent
+  FilterConfig.FilterIdLow = CAN_FILTER_STD(CAN_IAP_UPDATE_FIRMWARE);
+  FilterConfig.FilterMaskIdLow = CAN_FILTER_STD(CAN_IAP_UPDATE_FIRMWARE);
+  FilterConfig.FilterIdHigh = CAN_FILTER_STD(CAN_IAP_DATA);
+  FilterConfig.FilterMaskIdHigh = CAN_FILTER_STD(CAN_IAP_DATA);
+  FilterConfig.FilterFIFOAssignment = CAN_FILTER_FIFO0;
+  FilterConfig.FilterBank = CAN_FILTER_BANK_DATA;
+  if (HAL_CAN_ConfigFilter(&hcan1, &FilterConfig) != HAL_OK)
+  {
+    return HAL_ERROR;
+  }
+
+  // Sequenced data, CAN_IAP_UPDATE_FIRMWARE in the top 11 bits of an extended data frame
+  FilterConfig.FilterMode = CAN_FILTERMODE_IDMASK;
+  FilterConfig.FilterScale = CAN_FILTERSCALE_32BIT;
+  FilterConfig.FilterIdHigh = id >> 16;
+  FilterConfig.FilterIdLow = id & 0xFFFF;
+  FilterConfig.FilterMaskIdHigh = mask >> 16;
+  FilterConfig.FilterMaskIdLow = mask & 0xFFFF;
+  FilterConfig.FilterFIFOAssignment = CAN_FILTER_FIFO0;
+  FilterConfig.FilterBank = CAN_FILTER_BANK_SEQUENCED;
+  return HAL_CAN_ConfigFilter(&hcan1, &FilterConfig);
+}
+
+/**
+  * @brief  Counts a received frame against the filter that let it in. Called
+  *         for every frame read from an RX FIFO, so it also counts the frames
+  *         CAN_Rx_ISR_Cycles were spent on. Runs from RAM.
+  * @param  RxFifo CAN_RX_FIFO0 or CAN_RX_FIFO1
+  * @param  FilterMatchIndex from the frame's CAN_RxHeaderTypeDef
+  * @retval None
+  */
+__ramfunc void CAN_Count_Filter_Hit(uint32_t RxFifo, uint32_t FilterMatchIndex)
+{
+  uint8_t filter = CAN_FILTER_UNKNOWN;
 
+  if (RxFifo == CAN_RX_FIFO1)
+  {
+    if (FilterMatchIndex < CAN_FMI_CONTROL + 4)
+    {
+      filter = CAN_FILTER_CONTROL;
+    }
+  }
+  else if (FilterMatchIndex < CAN_FMI_COMMAND + 2)
+  {
+    filter = CAN_FILTER_COMMAND;
+  }
+  else if (FilterMatchIndex < CAN_FMI_DATA + 2)
+  {
+    filter = CAN_FILTER_DATA;
+  }
+  else if (FilterMatchIndex == CAN_FMI_SEQUENCED)
+  {
+    filter = CAN_FILTER_SEQUENCED;
+  }
+  CAN_Filter_Hits[filter]++;
+  CAN_Rx_ISR_Frames++;
+}
+
+/**
+  * @brief  Reads every frame pending in an RX FIFO in one interrupt, straight
+  *         from the FIFO mailbox registers instead of HAL_CAN_IRQHandler and
+  *         HAL_CAN_GetRxMessage. Commands and data are queued, control frames
+  *         go to IAP_Control_Frame first. Called from the CAN RX interrupts, so it
+  *         runs from RAM.
+  * @param  RxFifo CAN_RX_FIFO0 or CAN_RX_FIFO1
+  * @retval None
+  */
+__ramfunc void CAN1_Rx_Drain(uint32_t RxFifo)
+{
+  CAN_TypeDef *can = hcan1.Instance;
+  __IO uint32_t *rfr = (RxFifo == CAN_RX_FIFO0) ? &can->RF0R : &can->RF1R;
+  CAN_FIFOMailBox_TypeDef *mailbox = &can->sFIFOMailBox[RxFifo];
+  CAN_RxHeaderTypeDef header;
+  uint8_t data[8];
+  uint32_t rir;
+  uint32_t rdtr;
+  uint32_t rdlr;
+  uint32_t rdhr;
+
+  // RF0R and RF1R have the same layout
+  if ((*rfr & CAN_RF0R_FOVR0) != 0U)
+  {
+    IAP_Count_FIFO_Overrun(RxFifo);
+    *rfr = CAN_RF0R_FOVR0;
+  }
+  while ((*rfr & CAN_RF0R_FMP0) != 0U)
+  {
+    rir = mailbox->RIR;
+    rdtr = mailbox->RDTR;
+    rdlr = mailbox->RDLR;
+    rdhr = mailbox->RDHR;
+    // Release the mailbox first, the next frame can come in while this one is queued
+    *rfr = CAN_RF0R_RFOM0;
+
+    header.IDE = rir & CAN_RI0R_IDE;
+    header.StdId = (rir & CAN_RI0R_STID) >> CAN_TI0R_STID_Pos;
+    header.ExtId = (rir & (CAN_RI0R_EXID | CAN_RI0R_STID)) >> CAN_RI0R_EXID_Pos;
+    header.RTR = rir & CAN_RI0R_RTR;
+    header.DLC = (rdtr & CAN_RDT0R_DLC) >> CAN_RDT0R_DLC_Pos;
+    header.FilterMatchIndex = (rdtr & CAN_RDT0R_FMI) >> CAN_RDT0R_FMI_Pos;
+    header.Timestamp = (rdtr & CAN_RDT0R_TIME) >> CAN_RDT0R_TIME_Pos;
+    data[0] = rdlr;
+    data[1] = rdlr >> 8;
+    data[2] = rdlr >> 16;
+    data[3] = rdlr >> 24;
+    data[4] = rdhr;
+    data[5] = rdhr >> 8;
+    data[6] = rdhr >> 16;
+    data[7] = rdhr >> 24;
+
+    CAN_Count_Filter_Hit(RxFifo, header.FilterMatchIndex);
+    if (IAP_IS_IAP_FRAME(&header) &&
+        ((RxFifo == CAN_RX_FIFO0) || (IAP_Control_Frame(&header, data) == 0)))
+    {
+      IAP_Queue_Frame(&header, data);
+    }
+  }
+}
+
+/**
+  * @brief  Acknowledges the finished TX mailboxes, sent or failed, and 
+  *         refills them from the IAP transmit ring. Takes the place of 
+  *         HAL_CAN_IRQHandler on the TX interrupt with CAN_RX_FAST_PATH, which
+  *         would also read pending RX frames through the HAL callbacks. Runs
+  *         from RAM.
+  * @retval None
+  */
+__ramfunc void CAN1_Tx_Complete(void)
+{
+  CAN_TypeDef *can = hcan1.Instance;
+
+  // Writing RQCPx also clears TXOKx, ALSTx and TERRx
+  can->TSR = can->TSR & (CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2);
+  IAP_CAN_Drain_Tx();
+}
 /* USER CODE END 1 */
 
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
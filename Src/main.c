@@ -21,6 +21,7 @@
 /* Includes ------------------------------------------------------------------*/
 #include "main.h"
 #include "can.h"
+#include "crc.h"
 #include "gpio.h"
 
 /* Private includes ----------------------------------------------------------*/
@@ -78,6 +79,7 @@ int main(void)
   HAL_Init();
 
   /* USER CODE BEGIN Init */
+  IAP_Boot_Mark( IAP_BOOT_HAL_INIT );
 
   /* USER CODE END Init */
 
@@ -85,30 +87,25 @@ int main(void)
   SystemClock_Config();
 
   /* USER CODE BEGIN SysInit */
+  IAP_Boot_Mark( IAP_BOOT_CLOCK );
 
   /* USER CODE END SysInit */
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
   MX_CAN1_Init();
+  MX_CRC_Init();
   /* USER CODE BEGIN 2 */
   IAP_init( &hcan1 );
-  CAN_FilterTypeDef FilterConfig;
-  FilterConfig.FilterIdHigh = 0xFFFF;
-  FilterConfig.FilterIdLow = 0xFFFF;
-  FilterConfig.FilterMaskIdHigh = 0x0000;
-  FilterConfig.FilterMaskIdLow = 0x0000;
-  FilterConfig.FilterFIFOAssignment = CAN_FILTER_FIFO0;
-  FilterConfig.FilterBank = 0;
-  FilterConfig.FilterMode = CAN_FILTERMODE_IDMASK;
-  FilterConfig.FilterScale = CAN_FILTERSCALE_32BIT;
-  FilterConfig.FilterActivation = CAN_FILTER_ENABLE;
-  if( HAL_CAN_ConfigFilter(&hcan1, &FilterConfig) != HAL_OK )
+  if( CAN1_Filter_Init() != HAL_OK )
   {
     Error_Handler();
   }
-  HAL_CAN_ActivateNotification( &hcan1, CAN_IT_RX_FIFO0_MSG_PENDING );
+  HAL_CAN_ActivateNotification( &hcan1, CAN_IT_RX_FIFO0_MSG_PENDING | CAN_IT_RX_FIFO0_OVERRUN |
+                                        CAN_IT_RX_FIFO1_MSG_PENDING | CAN_IT_RX_FIFO1_OVERRUN |
+                                        CAN_IT_TX_MAILBOX_EMPTY );
   HAL_CAN_Start( &hcan1 );
+  IAP_Boot_Mark( IAP_BOOT_READY );
   /* USER CODE END 2 */
 
   /* Infinite loop */
@@ -118,6 +115,7 @@ int main(void)
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
+    IAP_Process_Queue();
   }
   /* USER CODE END 3 */
 }
@@ -169,6 +167,9 @@ void SystemClock_Config(void)
 }
 
 /* USER CODE BEGIN 4 */
+// HAL receive path, only used with CAN_RX_FAST_PATH set to 0. These callbacks
+// and the HAL functions they call stay in flash, so they stall while flash is
+// busy; CAN1_Rx_Drain and IAP_CAN_Drain_Tx are the RAM resident path.
 void HAL_CAN_RxFifo0MsgPendingCallback( CAN_HandleTypeDef *hcan )
 {
     CAN_RxHeaderTypeDef pHeader;
@@ -178,15 +179,63 @@ void HAL_CAN_RxFifo0MsgPendingCallback( CAN_HandleTypeDef *hcan )
       /* Reception Error */
       Error_Handler();
     }
-    if( pHeader.StdId == 0x600 )
+    CAN_Count_Filter_Hit(CAN_RX_FIFO0, pHeader.FilterMatchIndex);
+    if( IAP_IS_IAP_FRAME(&pHeader) )
     {
-      if( IAP_Route_Messages(&pHeader, aData) != HAL_OK );
-      {
-        /* IAP Error */
-        Error_Handler();
-      }
+      // Flash work is done by IAP_Process_Queue in the main loop
+      IAP_Queue_Frame(&pHeader, aData);
     }
 }
+
+// CAN_IAP_CONTROL frames, the only ones the filters put in FIFO1. Status 
+// queries and aborts are answered here, even while a page is committed.
+void HAL_CAN_RxFifo1MsgPendingCallback( CAN_HandleTypeDef *hcan )
+{
+    CAN_RxHeaderTypeDef pHeader;
+    uint8_t aData[8];
+    if( HAL_CAN_GetRxMessage(hcan, CAN_RX_FIFO1, &pHeader, aData) != HAL_OK )
+    {
+      /* Reception Error */
+      Error_Handler();
+    }
+    CAN_Count_Filter_Hit(CAN_RX_FIFO1, pHeader.FilterMatchIndex);
+    if( IAP_IS_IAP_FRAME(&pHeader) && (IAP_Control_Frame(&pHeader, aData) == 0) )
+    {
+      IAP_Queue_Frame(&pHeader, aData);
+    }
+}
+
+// A mailbox is free again, refill it from the IAP transmit ring
+void HAL_CAN_TxMailbox0CompleteCallback( CAN_HandleTypeDef *hcan )
+{
+    IAP_CAN_Drain_Tx();
+}
+
+void HAL_CAN_TxMailbox1CompleteCallback( CAN_HandleTypeDef *hcan )
+{
+    IAP_CAN_Drain_Tx();
+}
+
+void HAL_CAN_TxMailbox2CompleteCallback( CAN_HandleTypeDef *hcan )
+{
+    IAP_CAN_Drain_Tx();
+}
+
+void HAL_CAN_ErrorCallback( CAN_HandleTypeDef *hcan )
+{
+    uint32_t error = HAL_CAN_GetError(hcan);
+    if( (error & HAL_CAN_ERROR_RX_FOV0) != 0 )
+    {
+      IAP_Count_FIFO_Overrun(CAN_RX_FIFO0);
+    }
+    if( (error & HAL_CAN_ERROR_RX_FOV1) != 0 )
+    {
+      IAP_Count_FIFO_Overrun(CAN_RX_FIFO1);
+    }
+    HAL_CAN_ResetError(hcan);
+    // Failed transmissions free their mailbox too
+    IAP_CAN_Drain_Tx();
+}
 /* USER CODE END 4 */
 
 /**